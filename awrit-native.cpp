@@ -1,58 +1,188 @@
-#include <fcntl.h>
 #include <napi.h>
 #include <sys/mman.h>
-#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
-
-#if defined(__x86_64__) || defined(_M_X64)
-#include <immintrin.h>
-#elif defined(__aarch64__) || defined(_M_ARM64)
-#include <arm_neon.h>
-#endif
-
-#if defined(__AVX2__)
-constexpr size_t ALIGNMENT = 32;  // AVX2 alignment
-#elif defined(__ARM_NEON)
-constexpr size_t ALIGNMENT = 16;  // NEON alignment
-#else
-constexpr size_t ALIGNMENT = 4;  // Default alignment
-#endif
+#include <unordered_map>
+#include <vector>
 
 #include "escape_parser.h"
+#include "graphics/cpu_features.h"
+#include "graphics/deflate.h"
+#include "graphics/frame_diff.h"
+#include "graphics/frame_stats.h"
+#include "graphics/hash.h"
+#include "graphics/kitty_graphics.h"
+#include "graphics/scale.h"
+#include "graphics/scroll.h"
+#include "graphics/shm_segment.h"
+#include "graphics/swizzle.h"
+#include "graphics/tile_cache.h"
+#include "graphics/worker_pool.h"
 #include "input.h"
 #include "kitty_keys.h"
 #include "sgr_mouse.h"
 
-#define BYTES_PER_PIXEL 4
-
 using namespace Napi;
 
-// Helper function to align size to the required SIMD alignment
-constexpr size_t align_size(size_t size, size_t alignment) {
-  return (size + alignment - 1) & ~(alignment - 1);
+static graphics::Size GetSize(const Object& size) {
+  graphics::Size result;
+  if (size.Has("width") && size.Get("width").IsNumber()) {
+    result.width = size.Get("width").As<Number>().Uint32Value();
+  }
+  if (size.Has("height") && size.Get("height").IsNumber()) {
+    result.height = size.Get("height").As<Number>().Uint32Value();
+  }
+  return result;
+}
+
+// Reads a dirty rect, fields that are missing default to the entire frame
+static graphics::Rect GetRect(const Object& dirtyRect, graphics::Size size) {
+  graphics::Rect result{0, 0, size.width, size.height};
+
+  if (dirtyRect.Has("x") && dirtyRect.Get("x").IsNumber()) {
+    result.x = dirtyRect.Get("x").As<Number>().Uint32Value();
+  }
+
+  if (dirtyRect.Has("y") && dirtyRect.Get("y").IsNumber()) {
+    result.y = dirtyRect.Get("y").As<Number>().Uint32Value();
+  }
+
+  if (dirtyRect.Has("width") && dirtyRect.Get("width").IsNumber()) {
+    result.width = dirtyRect.Get("width").As<Number>().Uint32Value();
+  }
+
+  if (dirtyRect.Has("height") && dirtyRect.Get("height").IsNumber()) {
+    result.height = dirtyRect.Get("height").As<Number>().Uint32Value();
+  }
+
+  // Ensure dirty region is within bounds
+  return graphics::ClampRect(result, size);
 }
 
-inline void safe_close(int fd) {
-  while (close(fd) != 0 && errno == EINTR)
-    ;
+static Object RectToObject(Napi::Env env, const graphics::Rect& rect) {
+  Object result = Object::New(env);
+  result["x"] = Number::New(env, rect.x);
+  result["y"] = Number::New(env, rect.y);
+  result["width"] = Number::New(env, rect.width);
+  result["height"] = Number::New(env, rect.height);
+  return result;
 }
 
+// A BGRA frame within a JS buffer
+struct SourceFrame {
+  const char* data = nullptr;
+  graphics::Size size;
+  // Bytes between the start of each row
+  size_t stride = 0;
+};
+
+// Reads a source size, which may also have the stride of its rows and the
+// offset of its first row within |buffer|, as with padded bitmaps
+static bool GetSource(Napi::Env env,
+                      const Buffer<char>& buffer,
+                      const Object& sourceSize,
+                      SourceFrame& source) {
+  source.size = GetSize(sourceSize);
+  const size_t rowBytes = source.size.width * graphics::BYTES_PER_PIXEL;
+  int64_t stride = rowBytes;
+  int64_t offset = 0;
+  if (sourceSize.Has("stride") && sourceSize.Get("stride").IsNumber()) {
+    stride = sourceSize.Get("stride").As<Number>().Int64Value();
+  }
+  if (sourceSize.Has("offset") && sourceSize.Get("offset").IsNumber()) {
+    offset = sourceSize.Get("offset").As<Number>().Int64Value();
+  }
+
+  if (stride < static_cast<int64_t>(rowBytes) || offset < 0) {
+    TypeError::New(env, "Stride or offset is invalid")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+
+  // Only the pixels of the last row need to be present, not its padding
+  if (rowBytes != 0 && source.size.height != 0) {
+    const size_t length = buffer.Length();
+    size_t available = length - std::min<size_t>(length, offset);
+    size_t rows =
+        available < rowBytes ? 0 : (available - rowBytes) / stride + 1;
+    if (rows < source.size.height) {
+      TypeError::New(env, "Buffer is too small").ThrowAsJavaScriptException();
+      return false;
+    }
+  }
+
+  source.data = buffer.Data() + offset;
+  source.stride = stride;
+  return true;
+}
+
+static const char* MapSegment(graphics::ShmSegment& segment,
+                              size_t size,
+                              bool grow) {
+  using Status = graphics::ShmSegment::Status;
+  switch (segment.Map(size, grow)) {
+    case Status::Ok:
+      return nullptr;
+    case Status::OpenFailed:
+      return "Failed to open shared memory";
+    case Status::ResizeFailed:
+      return "Failed to resize shared memory";
+    case Status::MapFailed:
+      return "Failed to map shared memory";
+  }
+  return "Failed to map shared memory";
+}
+
+static bool MapSegment(Napi::Env env,
+                       graphics::ShmSegment& segment,
+                       size_t size,
+                       bool grow) {
+  const char* error = MapSegment(segment, size, grow);
+  if (error != nullptr) {
+    Error::New(env, error).ThrowAsJavaScriptException();
+    return false;
+  }
+  return true;
+}
+
+// Class constructors, per env since the addon can be loaded by several of
+// them, such as worker threads
+struct Constructors {
+  FunctionReference shmGraphicBuffer;
+  FunctionReference inputListener;
+};
+
 class ShmGraphicBuffer : public ObjectWrap<ShmGraphicBuffer> {
  public:
   static Object Init(Napi::Env env, Object exports) {
-    Function func =
-        DefineClass(env, "ShmGraphicBuffer",
-                    {InstanceMethod("write", &ShmGraphicBuffer::Write)});
+    Function func = DefineClass(
+        env, "ShmGraphicBuffer",
+        {InstanceMethod("write", &ShmGraphicBuffer::Write),
+         InstanceMethod("writeAsync", &ShmGraphicBuffer::WriteAsync),
+         InstanceMethod("scroll", &ShmGraphicBuffer::Scroll),
+         InstanceMethod("stats", &ShmGraphicBuffer::Stats),
+         InstanceMethod("resetStats", &ShmGraphicBuffer::ResetStats),
+         InstanceMethod("resize", &ShmGraphicBuffer::Resize),
+         InstanceMethod("close", &ShmGraphicBuffer::Close),
+         InstanceAccessor("hugePages", &ShmGraphicBuffer::HugePages,
+                          nullptr)});
 
-    FunctionReference* constructor = new FunctionReference();
-    *constructor = Persistent(func);
-    env.SetInstanceData(constructor);
+    env.GetInstanceData<Constructors>()->shmGraphicBuffer = Persistent(func);
 
     exports.Set("ShmGraphicBuffer", func);
     return exports;
@@ -62,28 +192,627 @@ class ShmGraphicBuffer : public ObjectWrap<ShmGraphicBuffer> {
       : ObjectWrap<ShmGraphicBuffer>(info) {
     Napi::Env env = info.Env();
 
-    if (info.Length() != 1 || !info[0].IsString()) {
-      TypeError::New(env, "Expected a string and two numbers")
+    if (info.Length() < 1 || !info[0].IsString()) {
+      TypeError::New(env, "Expected a name and optionally options")
           .ThrowAsJavaScriptException();
       return;
     }
 
-    name = info[0].As<String>().Utf8Value();
+    std::string name = info[0].As<String>().Utf8Value();
     if (name.empty()) {
       TypeError::New(env, "Name is invalid").ThrowAsJavaScriptException();
       return;
     }
+
+    bool hugePages = false;
+    if (info.Length() > 1 && info[1].IsObject()) {
+      Object options = info[1].As<Object>();
+      if (options.Has("persistent") && options.Get("persistent").IsBoolean()) {
+        persistent = options.Get("persistent").As<Boolean>().Value();
+      }
+      if (options.Has("hugePages") && options.Get("hugePages").IsBoolean()) {
+        hugePages = options.Get("hugePages").As<Boolean>().Value();
+      }
+      if (options.Has("stats") && options.Get("stats").IsBoolean() &&
+          options.Get("stats").As<Boolean>().Value()) {
+        stats = std::make_unique<graphics::FrameStats>();
+      }
+      if (options.Has("detectScroll") &&
+          options.Get("detectScroll").IsBoolean()) {
+        detectScroll = options.Get("detectScroll").As<Boolean>().Value();
+      }
+      if (options.Has("format") && options.Get("format").IsString()) {
+        std::string name = options.Get("format").As<String>().Utf8Value();
+        if (name == "rgb") {
+          format = graphics::PixelFormat::RGB;
+        } else if (name != "rgba") {
+          TypeError::New(env, "Format is invalid")
+              .ThrowAsJavaScriptException();
+          return;
+        }
+      }
+    }
+    segment =
+        std::make_unique<graphics::ShmSegment>(std::move(name), hugePages);
+    segment->set_stats(stats.get());
+  }
+
+ private:
+  // Unset when the whole frame is dirty
+  using DirtyRects = std::optional<std::vector<graphics::Rect>>;
+
+  // Swizzles on the libuv thread pool, keeping the buffer alive until done.
+  // Only the oldest write of a buffer is queued, the next one once it's done,
+  // so that frames land in the order they were given.
+  class WriteWorker : public AsyncWorker {
+   public:
+    WriteWorker(Napi::Env env,
+                ShmGraphicBuffer* target,
+                Buffer<char> buffer,
+                SourceFrame source,
+                graphics::Size targetSize,
+                DirtyRects dirty,
+                bool many)
+        : AsyncWorker(env, "ShmGraphicBufferWrite"),
+          deferred(Promise::Deferred::New(env)),
+          target(target),
+          self(Persistent(target->Value())),
+          buffer(Persistent(buffer)),
+          source(source),
+          targetSize(targetSize),
+          dirty(std::move(dirty)),
+          many(many) {}
+
+    Promise GetPromise() const { return deferred.Promise(); }
+
+   protected:
+    void Execute() override {
+      const char* error =
+          target->WriteFrame(source, targetSize, dirty, written, true);
+      if (error != nullptr)
+        SetError(error);
+    }
+
+    void OnOK() override {
+      deferred.Resolve(target->WrittenToValue(Env(), written, many));
+      target->NextWrite();
+    }
+
+    void OnError(const Error& error) override {
+      deferred.Reject(error.Value());
+      target->NextWrite();
+    }
+
+   private:
+    Promise::Deferred deferred;
+    ShmGraphicBuffer* target;
+    ObjectReference self;
+    Reference<Buffer<char>> buffer;
+    SourceFrame source;
+    graphics::Size targetSize;
+    DirtyRects dirty;
+    bool many;
+    std::vector<graphics::Rect> written;
+  };
+
+  bool CheckOpen(Napi::Env env) {
+    if (segment == nullptr)
+      return false;
+    if (closed) {
+      Error::New(env, "ShmGraphicBuffer is closed")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    return true;
+  }
+
+  // Drops the write that finished and queues the one after it, or finishes
+  // a close that waited for the writes to settle
+  void NextWrite() {
+    writes.pop_front();
+    if (!writes.empty())
+      writes.front()->Queue();
+    else if (closed)
+      CloseSegment();
+  }
+
+  void CloseSegment() {
+    std::lock_guard<std::mutex> lock(mutex);
+    segment->Close();
+  }
+
+  // Applies a resetStats that came in since, holding |mutex|
+  void ApplyStatsReset() {
+    if (stats != nullptr && statsReset.exchange(false))
+      stats->Reset();
+  }
+
+  // Copies the stats for stats() to read, holding |mutex|. A resetStats
+  // that came in during the work drops it.
+  void PublishStats() {
+    if (stats == nullptr)
+      return;
+    ApplyStatsReset();
+    std::lock_guard<std::mutex> lock(statsMutex);
+    statsSnapshot = *stats;
+  }
+
+  // Reads the arguments shared by write and writeAsync, |many| is set when
+  // the dirty rects were given as an array. |targetSize| is the size of the
+  // frame in the segment, which is the source size unless it is downscaled.
+  bool GetWriteArgs(const CallbackInfo& info,
+                    SourceFrame& source,
+                    graphics::Size& targetSize,
+                    DirtyRects& dirty,
+                    bool& many) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsBuffer() || !info[1].IsObject()) {
+      TypeError::New(env,
+                     "Expected a buffer, sourceSize, and optionally a "
+                     "destRect and targetSize")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    if (!CheckOpen(env))
+      return false;
+
+    if (!GetSource(env, info[0].As<Buffer<char>>(), info[1].As<Object>(),
+                   source))
+      return false;
+
+    const graphics::Size size = source.size;
+    targetSize = size;
+    if (info.Length() > 3 && info[3].IsObject()) {
+      targetSize = GetSize(info[3].As<Object>());
+      if (targetSize.width == 0 || targetSize.height == 0 ||
+          targetSize.width > size.width || targetSize.height > size.height) {
+        TypeError::New(env, "Target size is invalid")
+            .ThrowAsJavaScriptException();
+        return false;
+      }
+    }
+    many = info.Length() > 2 && info[2].IsArray();
+    if (many) {
+      Array rects = info[2].As<Array>();
+      dirty.emplace();
+      for (uint32_t i = 0; i < rects.Length(); ++i) {
+        Napi::Value rect = rects.Get(i);
+        if (rect.IsObject())
+          dirty->push_back(GetRect(rect.As<Object>(), size));
+      }
+      // Overlapping or adjacent rects are written in one go
+      dirty = graphics::CoalesceRects(std::move(*dirty));
+    } else if (info.Length() > 2 && info[2].IsObject()) {
+      dirty.emplace(1, GetRect(info[2].As<Object>(), size));
+    }
+    return true;
+  }
+
+  Napi::Value WrittenToValue(Napi::Env env,
+                             const std::vector<graphics::Rect>& written,
+                             bool many) {
+    // Tells JS which f= to transmit the written region with
+    auto toObject = [&](const graphics::Rect& rect) {
+      Object result = RectToObject(env, rect);
+      result["format"] = Number::New(env, static_cast<int>(format));
+      return result;
+    };
+    if (!many)
+      return toObject(written.front());
+
+    Array result = Array::New(env, written.size());
+    for (uint32_t i = 0; i < written.size(); ++i) {
+      result.Set(i, toObject(written[i]));
+    }
+    return result;
+  }
+
+  // Writes a frame into the segment, returning an error message on failure.
+  // May be called from any thread.
+  const char* WriteFrame(const SourceFrame& source,
+                         graphics::Size targetSize,
+                         const DirtyRects& dirty,
+                         std::vector<graphics::Rect>& written,
+                         bool parallel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed)
+      return "ShmGraphicBuffer is closed";
+
+    ApplyStatsReset();
+    const char* error =
+        WriteSegment(source, targetSize, dirty, written, parallel);
+    PublishStats();
+    return error;
+  }
+
+  const char* WriteSegment(const SourceFrame& source,
+                           graphics::Size targetSize,
+                           const DirtyRects& dirty,
+                           std::vector<graphics::Rect>& written,
+                           bool parallel) {
+    // Both do nothing unless stats were enabled
+    graphics::ScopedPhase framePhase(stats.get(), graphics::Phase::Frame);
+    graphics::ScopedFaults faults(stats.get());
+
+    const char* src = source.data;
+    const graphics::Size size = source.size;
+    const char* error = MapSegment(
+        *segment, graphics::frame_size(targetSize, format), persistent);
+    if (error != nullptr)
+      return error;
+
+    // Default dirty region is the entire buffer
+    std::vector<graphics::Rect> regions{
+        {0, 0, targetSize.width, targetSize.height}};
+    bool scaled = size.width != targetSize.width ||
+                  size.height != targetSize.height;
+
+    // A new segment or a new frame size has nothing to patch, so it is always
+    // written whole
+    bool resized = targetSize.width != lastTargetSize.width ||
+                   targetSize.height != lastTargetSize.height;
+    bool whole = !segment->preserved() || size.width != lastSize.width ||
+                 size.height != lastSize.height || resized;
+    if (!whole && dirty) {
+      regions = *dirty;
+      // Dirty rects are in source pixels
+      if (scaled) {
+        for (auto& region : regions) {
+          region = graphics::ScaleRect(region, size, targetSize);
+        }
+      }
+    }
+    lastSize = size;
+    lastTargetSize = targetSize;
+
+    // Rows outside of the dirty regions keep the hashes of the last frame
+    uint64_t* hashes = nullptr;
+    if (detectScroll) {
+      previousRowHashes = rowHashes;
+      if (resized) {
+        previousRowHashes.clear();
+        rowHashes.assign(targetSize.height, 0);
+      }
+      hashes = rowHashes.data();
+    }
+
+    // Apply RGBA fix (swap R and B channels) only for the dirty regions, all
+    // within the same mapping
+    written.clear();
+    {
+      graphics::ScopedPhase phase(stats.get(), graphics::Phase::Swizzle);
+      for (const auto& region : regions) {
+        if (scaled && parallel) {
+          written.push_back(graphics::SwizzleScaleRectParallel(
+              graphics::WorkerPool::Shared(), src, source.stride, size,
+              segment->data(), targetSize, region, format));
+        } else if (scaled) {
+          written.push_back(graphics::SwizzleScaleRect(
+              src, source.stride, size, segment->data(), targetSize, region,
+              format));
+        } else if (parallel) {
+          written.push_back(graphics::SwizzleRectParallel(
+              graphics::WorkerPool::Shared(), src, source.stride,
+              segment->data(), size, region, format, hashes));
+        } else {
+          written.push_back(
+              graphics::SwizzleRect(src, source.stride, segment->data(), size,
+                                    region, format, hashes));
+        }
+      }
+
+      // Rows that were only partly written, or scaled, are hashed afterwards
+      if (hashes != nullptr) {
+        const size_t rowBytes =
+            targetSize.width * graphics::bytes_per_pixel(format);
+        for (const auto& rect : written) {
+          if (!scaled && rect.x == 0 && rect.width == targetSize.width)
+            continue;
+          for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+            hashes[y] = graphics::HashBytes(segment->data() + y * rowBytes,
+                                            rowBytes);
+          }
+        }
+      }
+    }
+
+    if (stats != nullptr) {
+      ++stats->frames;
+      for (const auto& rect : written)
+        stats->bytes += rect.area() * graphics::bytes_per_pixel(format);
+    }
+
+    // Without persistence the segment is released after every frame
+    if (!persistent)
+      segment->Unmap();
+
+    return nullptr;
   }
 
-  ~ShmGraphicBuffer() {
-    if (fd != -1) {
-      safe_close(fd);
-      fd = -1;
-      shm_unlink(name.c_str());
+  // Estimates how far the content of the last written frame moved from the
+  // frame written before it
+  Napi::Value Scroll(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (!CheckOpen(env))
+      return env.Undefined();
+    if (!detectScroll) {
+      Error::New(env, "ShmGraphicBuffer was not created with detectScroll")
+          .ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Nothing to compare against, so the whole frame changed
+    graphics::Scroll scroll;
+    scroll.changed.push_back(
+        {0, 0, lastTargetSize.width, lastTargetSize.height});
+    if (!previousRowHashes.empty()) {
+      scroll = graphics::EstimateScroll(previousRowHashes.data(),
+                                        rowHashes.data(), lastTargetSize);
+    }
+
+    Object result = Object::New(env);
+    result["dy"] = Number::New(env, scroll.dy);
+    result["exposedRect"] = RectToObject(env, scroll.exposed);
+    Array changed = Array::New(env, scroll.changed.size());
+    for (uint32_t i = 0; i < scroll.changed.size(); ++i) {
+      changed.Set(i, RectToObject(env, scroll.changed[i]));
+    }
+    result["changedRects"] = changed;
+    return result;
+  }
+
+  bool CheckStats(Napi::Env env) {
+    if (!CheckOpen(env))
+      return false;
+    if (stats == nullptr) {
+      Error::New(env, "ShmGraphicBuffer was not created with stats")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    return true;
+  }
+
+  Napi::Value Stats(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (!CheckStats(env))
+      return env.Undefined();
+
+    // The snapshot of the last write, so a write in flight isn't waited on
+    graphics::FrameStats snapshot;
+    {
+      std::lock_guard<std::mutex> lock(statsMutex);
+      snapshot = statsSnapshot;
+    }
+    Object result = Object::New(env);
+    result["frames"] = Number::New(env, snapshot.frames);
+    result["bytes"] = Number::New(env, snapshot.bytes);
+    result["remaps"] = Number::New(env, snapshot.remaps);
+    result["minorFaults"] = Number::New(env, snapshot.minor_faults);
+    result["majorFaults"] = Number::New(env, snapshot.major_faults);
+
+    // Durations are in microseconds
+    Object phases = Object::New(env);
+    for (size_t i = 0; i < static_cast<size_t>(graphics::Phase::kCount); ++i) {
+      const auto phase = static_cast<graphics::Phase>(i);
+      const graphics::Histogram& histogram = snapshot[phase];
+      Object value = Object::New(env);
+      value["count"] = Number::New(env, histogram.count());
+      value["min"] = Number::New(env, histogram.min() / 1e3);
+      value["avg"] = Number::New(env, histogram.average() / 1e3);
+      value["p99"] = Number::New(env, histogram.Percentile(0.99) / 1e3);
+      value["max"] = Number::New(env, histogram.max() / 1e3);
+      phases[graphics::PhaseName(phase)] = value;
+    }
+    result["phases"] = phases;
+    return result;
+  }
+
+  Napi::Value ResetStats(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (!CheckStats(env))
+      return env.Undefined();
+
+    // The counters themselves are reset by the next write, which may be
+    // the one in flight
+    statsReset = true;
+    std::lock_guard<std::mutex> lock(statsMutex);
+    statsSnapshot.Reset();
+    return env.Undefined();
+  }
+
+  // Whether the segment was last seen backed by huge pages, it is only
+  // checked while mapped and no write is in flight
+  Napi::Value HugePages(const CallbackInfo& info) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (lock.owns_lock() && segment != nullptr && segment->mapped())
+      hugePagesMapped = segment->HugePagesMapped();
+    return Boolean::New(info.Env(), hugePagesMapped);
+  }
+
+  Napi::Value Resize(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsObject()) {
+      TypeError::New(env, "Expected a size").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+    if (!CheckOpen(env))
+      return env.Undefined();
+
+    graphics::Size size = GetSize(info[0].As<Object>());
+    if (size.width == 0 || size.height == 0) {
+      TypeError::New(env, "Size is invalid").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ApplyStatsReset();
+    const char* error =
+        MapSegment(*segment, graphics::frame_size(size, format), persistent);
+    if (error == nullptr && !persistent)
+      segment->Unmap();
+    PublishStats();
+    if (error != nullptr)
+      Error::New(env, error).ThrowAsJavaScriptException();
+
+    return env.Undefined();
+  }
+
+  // Queued writes are rejected and the one in flight closes the segment once
+  // it settles, instead of waiting for it here
+  Napi::Value Close(const CallbackInfo& info) {
+    if (segment != nullptr && !closed) {
+      closed = true;
+      if (writes.empty())
+        CloseSegment();
+    }
+    return info.Env().Undefined();
+  }
+
+  Napi::Value Write(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    SourceFrame source;
+    graphics::Size targetSize;
+    DirtyRects dirty;
+    bool many = false;
+    if (!GetWriteArgs(info, source, targetSize, dirty, many))
+      return env.Undefined();
+    // Would land before frames that were given earlier
+    if (!writes.empty()) {
+      Error::New(env, "ShmGraphicBuffer has a writeAsync in flight")
+          .ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    std::vector<graphics::Rect> written;
+    const char* error =
+        WriteFrame(source, targetSize, dirty, written, false);
+    if (error != nullptr) {
+      Error::New(env, error).ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    // Create and return the Rect objects with the dirty rectangle information
+    return WrittenToValue(env, written, many);
+  }
+
+  Napi::Value WriteAsync(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    SourceFrame source;
+    graphics::Size targetSize;
+    DirtyRects dirty;
+    bool many = false;
+    if (!GetWriteArgs(info, source, targetSize, dirty, many))
+      return env.Undefined();
+
+    auto* worker =
+        new WriteWorker(env, this, info[0].As<Buffer<char>>(), source,
+                        targetSize, std::move(dirty), many);
+    Promise promise = worker->GetPromise();
+    writes.push_back(worker);
+    if (writes.size() == 1)
+      worker->Queue();
+    return promise;
+  }
+
+  // Outlives the segment, which records into it until it is closed
+  std::unique_ptr<graphics::FrameStats> stats;
+  std::unique_ptr<graphics::ShmSegment> segment;
+  // Held while writing, which may be off the main thread
+  std::mutex mutex;
+  // Copied from |stats| after every write
+  graphics::FrameStats statsSnapshot;
+  std::mutex statsMutex;
+  std::atomic<bool> statsReset{false};
+  graphics::Size lastSize;
+  graphics::Size lastTargetSize;
+  graphics::PixelFormat format = graphics::PixelFormat::RGBA;
+  // Hashes of the rows of the last two frames, as written to the segment
+  std::vector<uint64_t> rowHashes;
+  std::vector<uint64_t> previousRowHashes;
+  // writeAsync calls that haven't settled, the front one is running
+  std::deque<WriteWorker*> writes;
+  bool detectScroll = false;
+  bool hugePagesMapped = false;
+  bool persistent = false;
+  // Set on the main thread, read by writes in flight
+  std::atomic<bool> closed{false};
+};
+
+// Rotates frames through several segments so that a frame can be written while
+// the terminal is still reading the previous ones
+class ShmGraphicBufferRing : public ObjectWrap<ShmGraphicBufferRing> {
+ public:
+  static constexpr uint32_t kDefaultSlots = 3;
+  static constexpr uint32_t kMaxSlots = 16;
+
+  static Object Init(Napi::Env env, Object exports) {
+    Function func = DefineClass(
+        env, "ShmGraphicBufferRing",
+        {InstanceMethod("write", &ShmGraphicBufferRing::Write),
+         InstanceMethod("release", &ShmGraphicBufferRing::Release),
+         InstanceMethod("close", &ShmGraphicBufferRing::Close)});
+
+    exports.Set("ShmGraphicBufferRing", func);
+    return exports;
+  }
+
+  ShmGraphicBufferRing(const CallbackInfo& info)
+      : ObjectWrap<ShmGraphicBufferRing>(info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+      TypeError::New(env, "Expected a name and optionally a count")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+
+    std::string name = info[0].As<String>().Utf8Value();
+    if (name.empty()) {
+      TypeError::New(env, "Name is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+
+    uint32_t count = kDefaultSlots;
+    if (info.Length() > 1 && info[1].IsNumber()) {
+      count = info[1].As<Number>().Uint32Value();
+    }
+    if (count == 0 || count > kMaxSlots) {
+      TypeError::New(env, "Count is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+
+    slots.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      slots[i].segment = std::make_unique<graphics::ShmSegment>(
+          name + "-" + std::to_string(i));
     }
   }
 
  private:
+  struct Slot {
+    std::unique_ptr<graphics::ShmSegment> segment;
+    // Region written to the other slots since this one was last written
+    graphics::Rect stale;
+    // Written, but not yet released by the terminal
+    bool busy = false;
+  };
+
+  bool CheckOpen(Napi::Env env) {
+    if (slots.empty())
+      return false;
+    if (closed) {
+      Error::New(env, "ShmGraphicBufferRing is closed")
+          .ThrowAsJavaScriptException();
+      return false;
+    }
+    return true;
+  }
+
   Napi::Value Write(const CallbackInfo& info) {
     Napi::Env env = info.Env();
 
@@ -93,172 +822,634 @@ class ShmGraphicBuffer : public ObjectWrap<ShmGraphicBuffer> {
           .ThrowAsJavaScriptException();
       return env.Undefined();
     }
+    if (!CheckOpen(env))
+      return env.Undefined();
 
-    Buffer<char> buffer = info[0].As<Buffer<char>>();
-    Object sourceSize = info[1].As<Object>();
-    uint32_t sourceWidth = 0;
-    uint32_t sourceHeight = 0;
+    // Every slot is still being read, the frame has to be dropped or retried
+    size_t index = next;
+    while (slots[index].busy) {
+      index = (index + 1) % slots.size();
+      if (index == next)
+        return env.Null();
+    }
+    Slot& slot = slots[index];
 
-    if (sourceSize.Has("width") && sourceSize.Get("width").IsNumber()) {
-      sourceWidth = sourceSize.Get("width").As<Number>().Uint32Value();
+    SourceFrame source;
+    if (!GetSource(env, info[0].As<Buffer<char>>(), info[1].As<Object>(),
+                   source))
+      return env.Undefined();
+    graphics::Size size = source.size;
+    graphics::Rect frame{0, 0, size.width, size.height};
+
+    if (size.width != lastSize.width || size.height != lastSize.height) {
+      for (auto& other : slots)
+        other.stale = frame;
+      lastSize = size;
     }
-    if (sourceSize.Has("height") && sourceSize.Get("height").IsNumber()) {
-      sourceHeight = sourceSize.Get("height").As<Number>().Uint32Value();
+
+    if (!MapSegment(env, *slot.segment, graphics::frame_size(size), true))
+      return env.Undefined();
+
+    graphics::Rect dirty = frame;
+    if (info.Length() > 2 && info[2].IsObject()) {
+      dirty = GetRect(info[2].As<Object>(), size);
     }
-    size_t alignedSize =
-        align_size(sourceWidth * sourceHeight * BYTES_PER_PIXEL, ALIGNMENT);
 
-    if (name.empty())
+    // The slot holds an older frame, so it also needs everything that changed
+    // since then
+    graphics::Rect region = slot.segment->preserved()
+                                ? graphics::UnionRect(slot.stale, dirty)
+                                : frame;
+    region = graphics::SwizzleRect(source.data, source.stride,
+                                   slot.segment->data(), size, region);
+
+    for (auto& other : slots)
+      other.stale = graphics::UnionRect(other.stale, dirty);
+    slot.stale = {};
+    slot.busy = true;
+    next = (index + 1) % slots.size();
+
+    Object result = RectToObject(env, region);
+    result["slot"] = Number::New(env, index);
+    result["name"] = String::New(env, slot.segment->name());
+    return result;
+  }
+
+  Napi::Value Release(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+      TypeError::New(env, "Expected a slot").ThrowAsJavaScriptException();
       return env.Undefined();
-    auto* name_cstr = name.c_str();
-#ifdef __APPLE__
-    // macOS can only run truncate on shared memory _once_, it needs to be
-    // unlinked first:
-    // https://github.com/apple/darwin-xnu/blob/a1babec6b135d1f35b2590a1990af3c5c5393479/bsd/kern/posix_shm.c#L523-L527
-    if (alignedSize != lastAlignedSize) {
-      if (fd != -1) {
-        safe_close(fd);
-        fd = -1;
+    }
+
+    uint32_t index = info[0].As<Number>().Uint32Value();
+    if (index >= slots.size()) {
+      TypeError::New(env, "Slot is invalid").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    slots[index].busy = false;
+    return env.Undefined();
+  }
+
+  Napi::Value Close(const CallbackInfo& info) {
+    if (!closed) {
+      for (auto& slot : slots)
+        slot.segment->Close();
+      closed = true;
+    }
+    return info.Env().Undefined();
+  }
+
+  std::vector<Slot> slots;
+  size_t next = 0;
+  graphics::Size lastSize;
+  bool closed = false;
+};
+
+// Writes frames as tiles that are each their own kitty image, tiles that were
+// already transmitted are reported by id so that they can be placed again
+// instead of sent.
+// The terminal unlinks a t=s segment once it has read it, so every fresh tile
+// gets a segment of its own, named after its id.
+class ShmTileCache : public ObjectWrap<ShmTileCache> {
+ public:
+  static Object Init(Napi::Env env, Object exports) {
+    Function func =
+        DefineClass(env, "ShmTileCache",
+                    {InstanceMethod("write", &ShmTileCache::Write),
+                     InstanceMethod("confirm", &ShmTileCache::Confirm),
+                     InstanceMethod("clear", &ShmTileCache::Clear),
+                     InstanceMethod("close", &ShmTileCache::Close)});
+
+    exports.Set("ShmTileCache", func);
+    return exports;
+  }
+
+  ShmTileCache(const CallbackInfo& info) : ObjectWrap<ShmTileCache>(info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString()) {
+      TypeError::New(env, "Expected a name and optionally options")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+
+    std::string name = info[0].As<String>().Utf8Value();
+    if (name.empty()) {
+      TypeError::New(env, "Name is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+
+    uint32_t tileSize = kDefaultTileSize;
+    uint32_t capacity = kDefaultCapacity;
+    uint32_t firstId = 1;
+    if (info.Length() > 1 && info[1].IsObject()) {
+      Object options = info[1].As<Object>();
+      if (options.Has("tileSize") && options.Get("tileSize").IsNumber()) {
+        tileSize = options.Get("tileSize").As<Number>().Uint32Value();
+      }
+      if (options.Has("capacity") && options.Get("capacity").IsNumber()) {
+        capacity = options.Get("capacity").As<Number>().Uint32Value();
+      }
+      if (options.Has("firstId") && options.Get("firstId").IsNumber()) {
+        firstId = options.Get("firstId").As<Number>().Uint32Value();
+      }
+    }
+    if (tileSize < kMinTileSize || tileSize > kMaxTileSize) {
+      TypeError::New(env, "Tile size is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+    if (capacity == 0) {
+      TypeError::New(env, "Capacity is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+    // Kitty ids are 32-bit and 0 means no id
+    if (firstId == 0 || firstId > UINT32_MAX - capacity) {
+      TypeError::New(env, "First id is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+
+    prefix = std::move(name);
+    cache = std::make_unique<graphics::TileCache>(tileSize, capacity, firstId);
+  }
+
+ private:
+  static constexpr uint32_t kDefaultTileSize = 64;
+  static constexpr uint32_t kMinTileSize = 16;
+  static constexpr uint32_t kMaxTileSize = 512;
+  static constexpr uint32_t kDefaultCapacity = 1024;
+
+  std::string SegmentName(uint32_t id) const {
+    return prefix + "-" + std::to_string(id);
+  }
+
+  bool CheckOpen(Napi::Env env) {
+    if (cache == nullptr)
+      return false;
+    if (closed) {
+      Error::New(env, "ShmTileCache is closed").ThrowAsJavaScriptException();
+      return false;
+    }
+    return true;
+  }
+
+  Napi::Value Write(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsBuffer() || !info[1].IsObject()) {
+      TypeError::New(env,
+                     "Expected a buffer, sourceSize, and optionally a destRect")
+          .ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+    if (!CheckOpen(env))
+      return env.Undefined();
+
+    SourceFrame source;
+    if (!GetSource(env, info[0].As<Buffer<char>>(), info[1].As<Object>(),
+                   source))
+      return env.Undefined();
+
+    graphics::Rect rect{0, 0, source.size.width, source.size.height};
+    if (info.Length() > 2 && info[2].IsObject()) {
+      rect = GetRect(info[2].As<Object>(), source.size);
+    }
+
+    // Tiles are hashed after they are swizzled, so they're written here first
+    // and only the fresh ones are copied out to their segments
+    pixels.resize(cache->SegmentSize(source.size));
+    std::vector<graphics::TileCache::Tile> tiles =
+        cache->Write(source.data, source.stride, source.size, rect,
+                     pixels.data());
+
+    Array array = Array::New(env, tiles.size());
+    for (uint32_t i = 0; i < tiles.size(); ++i) {
+      const auto& tile = tiles[i];
+      const size_t size = tile.rect.area() * graphics::BYTES_PER_PIXEL;
+      Object object = RectToObject(env, tile.rect);
+      object["id"] = Number::New(env, tile.id);
+      object["fresh"] = Boolean::New(env, tile.fresh);
+      object["size"] = Number::New(env, size);
+      if (tile.fresh) {
+        graphics::ShmSegment segment(SegmentName(tile.id));
+        const char* error = MapSegment(segment, size, false);
+        if (error != nullptr) {
+          // None of the frame is transmitted, including the tiles after this
+          for (const auto& written : tiles) {
+            if (written.fresh)
+              Unlink(written.id, false);
+          }
+          Error::New(env, error).ThrowAsJavaScriptException();
+          return env.Undefined();
+        }
+        memcpy(segment.data(), pixels.data() + tile.offset, size);
+        // Left linked for the terminal to open
+        segment.Unmap();
+        object["name"] = String::New(env, segment.name());
       }
-      shm_unlink(name_cstr);
+      array.Set(i, object);
     }
-#endif
-    while (true) {
-      int fd_ = shm_open(name_cstr, O_CREAT | O_RDWR, 0600);
-      if (fd_ == -1 && errno == EINTR)
+
+    Object result = Object::New(env);
+    result["tiles"] = array;
+    return result;
+  }
+
+  // Forgets the fresh tile of |id| and its segment, if the terminal didn't
+  // read it
+  void Unlink(uint32_t id, bool transmitted) {
+    cache->Confirm(id, transmitted);
+    shm_unlink(SegmentName(id).c_str());
+  }
+
+  Napi::Value Confirm(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsArray()) {
+      TypeError::New(env, "Expected ids and optionally whether they were sent")
+          .ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+    if (!CheckOpen(env))
+      return env.Undefined();
+
+    bool transmitted = true;
+    if (info.Length() > 1 && info[1].IsBoolean())
+      transmitted = info[1].As<Boolean>().Value();
+
+    Array ids = info[0].As<Array>();
+    for (uint32_t i = 0; i < ids.Length(); ++i) {
+      Napi::Value id = ids.Get(i);
+      if (!id.IsNumber())
         continue;
-      fd = fd_;
-      break;
+      if (transmitted) {
+        cache->Confirm(id.As<Number>().Uint32Value(), true);
+      } else {
+        Unlink(id.As<Number>().Uint32Value(), false);
+      }
+    }
+    return env.Undefined();
+  }
+
+  // Unlinks the segments of tiles that were never confirmed, which the
+  // terminal may not have read
+  void UnlinkPending() {
+    cache->ForEachPending(
+        [this](uint32_t id) { shm_unlink(SegmentName(id).c_str()); });
+  }
+
+  Napi::Value Clear(const CallbackInfo& info) {
+    if (cache != nullptr) {
+      UnlinkPending();
+      cache->Clear();
+    }
+    return info.Env().Undefined();
+  }
+
+  Napi::Value Close(const CallbackInfo& info) {
+    if (cache != nullptr && !closed) {
+      UnlinkPending();
+      pixels = {};
+      closed = true;
+    }
+    return info.Env().Undefined();
+  }
+
+  std::string prefix;
+  std::vector<char> pixels;
+  std::unique_ptr<graphics::TileCache> cache;
+  bool closed = false;
+};
+
+// Tracks the previous frame to find which tiles of a new frame changed
+class FrameDiff : public ObjectWrap<FrameDiff> {
+ public:
+  static Object Init(Napi::Env env, Object exports) {
+    Function func =
+        DefineClass(env, "FrameDiff",
+                    {InstanceMethod("diff", &FrameDiff::Diff),
+                     InstanceMethod("reset", &FrameDiff::Reset)});
+
+    exports.Set("FrameDiff", func);
+    return exports;
+  }
+
+  FrameDiff(const CallbackInfo& info) : ObjectWrap<FrameDiff>(info) {
+    Napi::Env env = info.Env();
+
+    uint32_t tileSize = graphics::FrameDiff::kDefaultTileSize;
+    if (info.Length() > 0 && info[0].IsObject()) {
+      Object options = info[0].As<Object>();
+      if (options.Has("tileSize") && options.Get("tileSize").IsNumber()) {
+        tileSize = options.Get("tileSize").As<Number>().Uint32Value();
+      }
     }
-    if (fd == -1) {
-      perror("shm_open");
-      Error::New(env, "Failed to open shared memory")
+    if (tileSize < kMinTileSize || tileSize > kMaxTileSize) {
+      TypeError::New(env, "Tile size is invalid").ThrowAsJavaScriptException();
+      return;
+    }
+
+    diff = std::make_unique<graphics::FrameDiff>(tileSize);
+  }
+
+ private:
+  static constexpr uint32_t kMinTileSize = 8;
+  static constexpr uint32_t kMaxTileSize = 1024;
+
+  Napi::Value Diff(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsBuffer() || !info[1].IsObject()) {
+      TypeError::New(env,
+                     "Expected a buffer, sourceSize, and optionally a destRect")
           .ThrowAsJavaScriptException();
       return env.Undefined();
     }
+    if (diff == nullptr)
+      return env.Undefined();
+
+    Buffer<char> buffer = info[0].As<Buffer<char>>();
+    graphics::Size size = GetSize(info[1].As<Object>());
+    if (buffer.Length() < graphics::frame_bytes(size)) {
+      TypeError::New(env, "Buffer is too small").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+
+    graphics::Rect rect{0, 0, size.width, size.height};
+    if (info.Length() > 2 && info[2].IsObject()) {
+      rect = GetRect(info[2].As<Object>(), size);
+    }
+
+    std::vector<graphics::Rect> dirty = diff->Diff(buffer.Data(), size, rect);
+    Array result = Array::New(env, dirty.size());
+    for (uint32_t i = 0; i < dirty.size(); ++i) {
+      result.Set(i, RectToObject(env, dirty[i]));
+    }
+    return result;
+  }
+
+  Napi::Value Reset(const CallbackInfo& info) {
+    if (diff != nullptr)
+      diff->Reset();
+    return info.Env().Undefined();
+  }
+
+  std::unique_ptr<graphics::FrameDiff> diff;
+};
+
+// Encodes frames as kitty graphics escapes for direct transmission, used when
+// shared memory can't reach the terminal
+class KittyGraphicsEncoder : public ObjectWrap<KittyGraphicsEncoder> {
+ public:
+  static Object Init(Napi::Env env, Object exports) {
+    Function func = DefineClass(
+        env, "KittyGraphicsEncoder",
+        {InstanceMethod("encode", &KittyGraphicsEncoder::Encode),
+         InstanceMethod("encodeAsync", &KittyGraphicsEncoder::EncodeAsync),
+         InstanceAccessor("compressionLevel",
+                          &KittyGraphicsEncoder::CompressionLevel, nullptr)});
+
+    exports.Set("KittyGraphicsEncoder", func);
+    return exports;
+  }
+
+  KittyGraphicsEncoder(const CallbackInfo& info)
+      : ObjectWrap<KittyGraphicsEncoder>(info) {
+    Napi::Env env = info.Env();
+
+    bool compress = false;
+    double frameBudget = kDefaultFrameBudget;
+    if (info.Length() > 0 && info[0].IsObject()) {
+      Object options = info[0].As<Object>();
+      if (options.Has("compress") && options.Get("compress").IsBoolean()) {
+        compress = options.Get("compress").As<Boolean>().Value();
+      }
+      if (options.Has("frameBudget") &&
+          options.Get("frameBudget").IsNumber()) {
+        frameBudget = options.Get("frameBudget").As<Number>().DoubleValue();
+      }
+    }
+    if (!(frameBudget > 0)) {
+      TypeError::New(env, "Frame budget is invalid")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+
+    if (compress) {
+      deflater = std::make_unique<graphics::Deflater>(
+          std::chrono::microseconds(static_cast<int64_t>(frameBudget * 1000)));
+    }
+  }
+
+ private:
+  // 60 frames per second, in milliseconds
+  static constexpr double kDefaultFrameBudget = 1000.0 / 60;
+
+  struct EncodeArgs {
+    graphics::Size size;
+    graphics::Rect rect;
+    std::string control;
+  };
+
+  // Compresses and encodes on the libuv thread pool, keeping the buffers
+  // alive until done. The output is its own until then, calls made meanwhile
+  // are given another.
+  class EncodeWorker : public AsyncWorker {
+   public:
+    EncodeWorker(Napi::Env env,
+                 KittyGraphicsEncoder* target,
+                 Buffer<char> buffer,
+                 ArrayBuffer output,
+                 EncodeArgs args)
+        : AsyncWorker(env, "KittyGraphicsEncoderEncode"),
+          deferred(Promise::Deferred::New(env)),
+          target(target),
+          self(Persistent(target->Value())),
+          buffer(Persistent(buffer)),
+          output(Persistent(output)),
+          data(buffer.Data()),
+          out(static_cast<char*>(output.Data())),
+          args(std::move(args)) {}
+
+    Promise GetPromise() const { return deferred.Promise(); }
+
+   protected:
+    void Execute() override {
+      length = target->EncodeFrame(data, args, out);
+    }
+
+    void OnOK() override {
+      deferred.Resolve(Uint8Array::New(Env(), length, output.Value(), 0));
+      target->Recycle(output.Value());
+    }
+
+    void OnError(const Error& error) override {
+      deferred.Reject(error.Value());
+      target->Recycle(output.Value());
+    }
+
+   private:
+    Promise::Deferred deferred;
+    KittyGraphicsEncoder* target;
+    ObjectReference self;
+    Reference<Buffer<char>> buffer;
+    Reference<ArrayBuffer> output;
+    const char* data;
+    char* out;
+    EncodeArgs args;
+    size_t length = 0;
+  };
+
+  bool GetEncodeArgs(const CallbackInfo& info, EncodeArgs& args) {
+    Napi::Env env = info.Env();
 
-    if (alignedSize != lastAlignedSize && ftruncate(fd, alignedSize) == -1) {
-      perror("ftruncate");
-      if (fd != -1) {
-        safe_close(fd);
-        fd = -1;
-      }
-      Error::New(env, "Failed to resize shared memory")
+    if (info.Length() < 2 || !info[0].IsBuffer() || !info[1].IsObject()) {
+      TypeError::New(env,
+                     "Expected a buffer, sourceSize, and optionally a "
+                     "destRect and control keys")
           .ThrowAsJavaScriptException();
-      return env.Undefined();
+      return false;
     }
 
-    // Default dirty region is the entire buffer
-    uint32_t dirtyX = 0;
-    uint32_t dirtyY = 0;
-    uint32_t dirtyWidth = sourceWidth;
-    uint32_t dirtyHeight = sourceHeight;
+    Buffer<char> buffer = info[0].As<Buffer<char>>();
+    args.size = GetSize(info[1].As<Object>());
+    if (buffer.Length() < graphics::frame_bytes(args.size)) {
+      TypeError::New(env, "Buffer is too small").ThrowAsJavaScriptException();
+      return false;
+    }
 
-    // Check for dirty rectangle parameter
+    args.rect = {0, 0, args.size.width, args.size.height};
     if (info.Length() > 2 && info[2].IsObject()) {
-      Object dirtyRect = info[2].As<Object>();
-
-      if (dirtyRect.Has("x") && dirtyRect.Get("x").IsNumber()) {
-        dirtyX = dirtyRect.Get("x").As<Number>().Uint32Value();
-      }
+      args.rect = GetRect(info[2].As<Object>(), args.size);
+    }
 
-      if (dirtyRect.Has("y") && dirtyRect.Get("y").IsNumber()) {
-        dirtyY = dirtyRect.Get("y").As<Number>().Uint32Value();
-      }
+    if (info.Length() > 3 && info[3].IsString()) {
+      args.control = info[3].As<String>().Utf8Value();
+    }
+    return true;
+  }
 
-      if (dirtyRect.Has("width") && dirtyRect.Get("width").IsNumber()) {
-        dirtyWidth = dirtyRect.Get("width").As<Number>().Uint32Value();
-      }
+  // Electron doesn't allow external array buffers, so the escapes are written
+  // to one owned by JS that is kept around between frames. encodeAsync takes
+  // it until it settles, so that overlapping calls don't share it.
+  ArrayBuffer Reserve(Napi::Env env, const EncodeArgs& args) {
+    size_t bytes = args.rect.area() * graphics::BYTES_PER_PIXEL;
+    size_t needed =
+        deflater != nullptr
+            ? graphics::kitty::MaxEncodedSize(graphics::Deflater::Bound(bytes),
+                                              args.control)
+            : graphics::kitty::MaxEncodedSize(args.rect, args.control);
+    size_t capacity = output.IsEmpty() ? 0 : output.Value().ByteLength();
+    if (capacity < needed) {
+      capacity = std::max(needed, capacity + capacity / 2);
+      output = Persistent(ArrayBuffer::New(env, capacity));
+    }
+    return output.Value();
+  }
 
-      if (dirtyRect.Has("height") && dirtyRect.Get("height").IsNumber()) {
-        dirtyHeight = dirtyRect.Get("height").As<Napi::Number>().Uint32Value();
-      }
+  // Takes back the output of an encodeAsync that settled, unless another one
+  // was made while it was pending
+  void Recycle(ArrayBuffer buffer) {
+    if (output.IsEmpty())
+      output = Persistent(buffer);
+  }
 
-      // Ensure dirty region is within bounds
-      if (dirtyX >= sourceWidth)
-        dirtyX = 0;
-      if (dirtyY >= sourceHeight)
-        dirtyY = 0;
-      if (dirtyX + dirtyWidth > sourceWidth)
-        dirtyWidth = sourceWidth - dirtyX;
-      if (dirtyY + dirtyHeight > sourceHeight)
-        dirtyHeight = sourceHeight - dirtyY;
-    }
-
-    // Map the shared memory
-    void* ptr = mmap(0, alignedSize, PROT_WRITE, MAP_SHARED, this->fd, 0);
-    if (ptr == MAP_FAILED) {
-      Napi::Error::New(env, "Failed to map shared memory")
-          .ThrowAsJavaScriptException();
-      return env.Undefined();
+  // Writes the escapes for a frame to |out|, returning their length.
+  // May be called from any thread.
+  size_t EncodeFrame(const char* src, const EncodeArgs& args, char* out) {
+    if (deflater == nullptr) {
+      return graphics::kitty::Encode(src, args.size, args.rect, args.control,
+                                     out);
     }
 
-    // Apply RGBA fix (swap R and B channels) only for the dirty region
-    const char* src = buffer.Data();
-    char* dst = (char*)ptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t bytes = args.rect.area() * graphics::BYTES_PER_PIXEL;
+    compressed.resize(graphics::Deflater::Bound(bytes));
+    size_t length =
+        deflater->Compress(src, args.size, args.rect, compressed.data());
+    // Falls back to uncompressed pixels, which always fit in |out|
+    if (length == 0) {
+      return graphics::kitty::Encode(src, args.size, args.rect, args.control,
+                                     out);
+    }
+    return graphics::kitty::EncodeCompressed(compressed.data(), length,
+                                             args.rect, args.control, out);
+  }
 
-    // Calculate offsets and strides
-    size_t rowStride = sourceWidth * BYTES_PER_PIXEL;
-    size_t dirtyOffset = dirtyX * BYTES_PER_PIXEL;
+  Napi::Value Encode(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
 
-    // Align the dirty region width to the appropriate SIMD boundary
-    // This ensures we always process complete SIMD blocks
-    size_t dirtyRowSize = align_size(dirtyWidth * BYTES_PER_PIXEL, ALIGNMENT);
+    EncodeArgs args;
+    if (!GetEncodeArgs(info, args))
+      return env.Undefined();
 
-    // Process each row in the dirty region
-    for (uint32_t y = 0; y < dirtyHeight; y++) {
-      size_t rowOffset = dirtyOffset + y * rowStride;
+    ArrayBuffer arrayBuffer = Reserve(env, args);
+    size_t length =
+        EncodeFrame(info[0].As<Buffer<char>>().Data(), args,
+                    static_cast<char*>(arrayBuffer.Data()));
+    return Uint8Array::New(env, length, arrayBuffer, 0);
+  }
 
-#if defined(__AVX2__)
-      const __m256i shuffle_mask = _mm256_set_epi8(
-          31, 28, 29, 30, 27, 24, 25, 26, 23, 20, 21, 22, 19, 16, 17, 18, 15,
-          12, 13, 14, 11, 8, 9, 10, 7, 4, 5, 6, 3, 0, 1, 2);
-      for (size_t i = rowOffset; i < rowOffset + dirtyRowSize; i += 32) {
-        __m256i pixels = _mm256_loadu_si256((__m256i*)(src + i));
-        __m256i shuffled = _mm256_shuffle_epi8(pixels, shuffle_mask);
-        _mm256_storeu_si256((__m256i*)(dst + i), shuffled);
-      }
-#elif defined(__ARM_NEON)
-      const uint8x16_t shuffle_mask = {2,  1, 0, 3,  6,  5,  4,  7,
-                                       10, 9, 8, 11, 14, 13, 12, 15};
-      for (size_t i = rowOffset; i < rowOffset + dirtyRowSize; i += 16) {
-        uint8x16_t pixels = vld1q_u8((uint8_t*)(src + i));
-        uint8x16_t shuffled = vqtbl1q_u8(pixels, shuffle_mask);
-        vst1q_u8((uint8_t*)(dst + i), shuffled);
-      }
-#else
-      // Fallback scalar implementation for the dirty region
-      for (size_t i = rowOffset; i < rowOffset + dirtyRowSize; i += 4) {
-        dst[i] = src[i + 2];      // R
-        dst[i + 1] = src[i + 1];  // G
-        dst[i + 2] = src[i];      // B
-        dst[i + 3] = src[i + 3];  // A
-      }
-#endif
-    }
+  Napi::Value EncodeAsync(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
 
-    // Unmap the shared memory
-    munmap(ptr, alignedSize);
-    if (fd != -1) {
-      close(fd);
-      fd = -1;
-    }
+    EncodeArgs args;
+    if (!GetEncodeArgs(info, args))
+      return env.Undefined();
 
-    // Create and return a Rect object with the dirty rectangle information
-    Object result = Object::New(env);
-    result["x"] = Number::New(env, dirtyX);
-    result["y"] = Number::New(env, dirtyY);
-    result["width"] = Number::New(env, dirtyRowSize / BYTES_PER_PIXEL);
-    result["height"] = Number::New(env, dirtyHeight);
+    ArrayBuffer arrayBuffer = Reserve(env, args);
+    output.Reset();
+    auto* worker = new EncodeWorker(env, this, info[0].As<Buffer<char>>(),
+                                    arrayBuffer, std::move(args));
+    Promise promise = worker->GetPromise();
+    worker->Queue();
+    return promise;
+  }
 
-    return result;
+  Napi::Value CompressionLevel(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (deflater == nullptr)
+      return Number::New(env, 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    return Number::New(env, deflater->level());
   }
 
-  std::string name;
-  int fd;
-  size_t lastAlignedSize;
+  std::unique_ptr<graphics::Deflater> deflater;
+  std::vector<char> compressed;
+  std::mutex mutex;
+  Reference<ArrayBuffer> output;
 };
 
+Value GetCpuFeatures(const CallbackInfo& info) {
+  Env env = info.Env();
+  const graphics::CpuFeatures& features = graphics::GetCpuFeatures();
+  Object result = Object::New(env);
+  result["kernel"] = String::New(env, graphics::IsaName(graphics::ActiveIsa()));
+  result["ssse3"] = Boolean::New(env, features.ssse3);
+  result["avx2"] = Boolean::New(env, features.avx2);
+  result["avx512bw"] = Boolean::New(env, features.avx512bw);
+  result["neon"] = Boolean::New(env, features.neon);
+  return result;
+}
+
+// Sets the region size from which frames are written with non-temporal
+// stores, returning the previous one
+Value SetStreamingThreshold(const CallbackInfo& info) {
+  Env env = info.Env();
+  size_t previous = graphics::StreamingThreshold();
+  if (info.Length() > 0) {
+    if (!info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0) {
+      TypeError::New(env, "Expected a number of bytes")
+          .ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+    graphics::SetStreamingThreshold(info[0].As<Number>().Int64Value());
+  }
+  return Number::New(env, previous);
+}
+
 Value SetupInput(const CallbackInfo& info) {
   Env env = info.Env();
   tty::in::Setup();
@@ -273,13 +1464,124 @@ Value CleanupInput(const CallbackInfo& info) {
   return env.Undefined();
 }
 
-static std::atomic<bool> s_quit = false;
-
 struct Event {
-  Event(tty::EscapeCodeParser::Type type_, const std::string& string_)
+  Event(tty::EscapeCodeParser::Type type_, std::string_view string_)
       : type(type_), string(string_) {}
-  const tty::EscapeCodeParser::Type type;
-  const std::string string;
+  tty::EscapeCodeParser::Type type;
+  std::string string;
+  // Events that were folded into this one by coalescing
+  uint32_t coalesced = 0;
+  // More of the same paste follows
+  bool partial = false;
+};
+
+// Key and mouse events as fixed size records in an ArrayBuffer, so that they
+// reach JS without allocating on either side. The listener thread appends
+// records to memory of its own and publishes them with a release store of the
+// write count. The main thread copies them to the ArrayBuffer right before
+// calling back, and takes how far JS has read after, so the ArrayBuffer is
+// only ever touched on the main thread and can't be freed under the listener
+// by a transfer. The listener waits for JS to read rather than drop records
+// when it's full. Everything is in int32 words, see InputRing in index.js.
+class InputRing {
+ public:
+  static constexpr uint32_t kHeaderWords = 8;
+  static constexpr uint32_t kRecordWords = 8;
+  // Counts wrap at 2^32, which capacity divides evenly
+  enum Header : uint32_t { kWrite, kRead, kCapacity };
+  enum Field : uint32_t {
+    kType,
+    kEvent,
+    kModifiers,
+    // The key or codepoint of keys, the buttons of the mouse
+    kKey,
+    kX,
+    kY,
+    kCoalesced,
+  };
+
+  static constexpr uint32_t kMaxCapacity = 1 << 20;
+
+  InputRing(Napi::Env env, uint32_t capacity) {
+    capacity_ = 1;
+    while (capacity_ < std::min(capacity, kMaxCapacity))
+      capacity_ <<= 1;
+    records_ = std::make_unique<int32_t[]>(capacity_ * kRecordWords);
+    ArrayBuffer buffer = ArrayBuffer::New(
+        env, (kHeaderWords + capacity_ * kRecordWords) * sizeof(int32_t));
+    std::memset(buffer.Data(), 0, buffer.ByteLength());
+    static_cast<int32_t*>(buffer.Data())[kCapacity] = capacity_;
+    buffer_ = Persistent(buffer);
+  }
+
+  ArrayBuffer buffer() const { return buffer_.Value(); }
+
+  // Listener thread
+
+  // Whether JS has to read before another record can be appended
+  bool Full() const {
+    return written_ - read_.load(std::memory_order_acquire) >= capacity_;
+  }
+
+  // Copies |record| in after the last one, only when it isn't Full
+  void Append(const int32_t* record) {
+    std::memcpy(Record(written_++), record, kRecordWords * sizeof(int32_t));
+  }
+
+  // Makes the appended records visible to the main thread
+  void Publish() { published_.store(written_, std::memory_order_release); }
+
+  // Main thread
+
+  // Copies the records published since the last call to the ArrayBuffer
+  void Sync() {
+    const uint32_t published = published_.load(std::memory_order_acquire);
+    ArrayBuffer buffer = buffer_.Value();
+    if (buffer.IsDetached())
+      return;
+    int32_t* words = static_cast<int32_t*>(buffer.Data());
+    for (; synced_ != published; ++synced_) {
+      std::memcpy(words + kHeaderWords +
+                      (synced_ & (capacity_ - 1)) * kRecordWords,
+                  Record(synced_), kRecordWords * sizeof(int32_t));
+    }
+    words[kWrite] = static_cast<int32_t>(synced_);
+  }
+
+  // Takes how far JS has read, returning whether that made room. Once the
+  // ArrayBuffer was detached nobody reads it, so everything counts as read.
+  bool Consume() {
+    ArrayBuffer buffer = buffer_.Value();
+    const uint32_t previous = read_.load(std::memory_order_relaxed);
+    uint32_t read;
+    if (buffer.IsDetached()) {
+      read = published_.load(std::memory_order_acquire);
+    } else {
+      read = static_cast<int32_t*>(buffer.Data())[kRead];
+      // JS can't have read what wasn't copied to it yet
+      if (read - previous > synced_ - previous)
+        return false;
+    }
+    if (read == previous)
+      return false;
+    read_.store(read, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  int32_t* Record(uint32_t count) const {
+    return records_.get() + (count & (capacity_ - 1)) * kRecordWords;
+  }
+
+  Reference<ArrayBuffer> buffer_;
+  std::unique_ptr<int32_t[]> records_;
+  uint32_t capacity_;
+  std::atomic<uint32_t> published_{0};
+  std::atomic<uint32_t> read_{0};
+  // Only touched by the listener thread
+  uint32_t written_ = 0;
+  // Only touched by the main thread
+  uint32_t synced_ = 0;
 };
 
 class InputEventParser final : public tty::EscapeCodeParser {
@@ -299,20 +1601,63 @@ class InputEventParser final : public tty::EscapeCodeParser {
     return obj;
   }
 
-  static Object HandleCSI(Env env, const std::string& csi) {
+  // Key names and modifiers point to static storage, so their JS strings are
+  // created once and reused for every event
+  String Intern(Env env, std::u16string_view name) {
+    auto it = strings_.find(name);
+    if (it == strings_.end()) {
+      it = strings_
+               .emplace(name, Persistent(String::New(env, name.data(),
+                                                     name.size())))
+               .first;
+    }
+    return it->second.Value();
+  }
+
+  // Typed ASCII arrives one character per event, so those strings are reused
+  String Character(Env env, const std::string& text) {
+    if (text.size() != 1 || static_cast<uint8_t>(text[0]) >= ascii_.size())
+      return String::New(env, text);
+    Reference<String>& cached = ascii_[static_cast<uint8_t>(text[0])];
+    if (cached.IsEmpty())
+      cached = Persistent(String::New(env, text));
+    return cached.Value();
+  }
+
+  static String CodepointsToString(Env env, const tty::keys::KeyEvent& key) {
+    char16_t text[tty::keys::KeyEvent::kMaxCodepoints * 2];
+    size_t length = 0;
+    for (size_t i = 0; i < key.codepoint_count; ++i) {
+      uint32_t codepoint = key.codepoints[i];
+      if (codepoint >= 0x10000) {
+        codepoint -= 0x10000;
+        text[length++] = static_cast<char16_t>(0xd800 + (codepoint >> 10));
+        text[length++] = static_cast<char16_t>(0xdc00 + (codepoint & 0x3ff));
+      } else {
+        text[length++] = static_cast<char16_t>(codepoint);
+      }
+    }
+    return String::New(env, text, length);
+  }
+
+  Object HandleCSI(Env env, const std::string& csi) {
     auto obj = Object::New(env);
 
-    const auto& [keyEvent, keyString] = tty::keys::ElectronKeyEventFromCSI(csi);
-    if (keyEvent != tty::keys::Event::Invalid) {
+    const tty::keys::KeyEvent key = tty::keys::KeyEventFromCSI(csi);
+    const tty::keys::ElectronKeyEvent electron =
+        tty::keys::ToElectronKeyEvent(key);
+    if (electron.event != tty::keys::Event::Invalid) {
       obj["type"] =
           Number::New(env, static_cast<int>(tty::EscapeCodeParser::Type::Key));
-      obj["event"] = Number::New(env, keyEvent);
-      auto modifiers = Array::New(env);
-      for (size_t index = 0; index < keyString.size() - 1; ++index) {
-        modifiers.Set(index, String::New(env, keyString[index]));
+      obj["event"] = Number::New(env, electron.event);
+      auto modifiers = Array::New(env, electron.modifier_count);
+      for (size_t index = 0; index < electron.modifier_count; ++index) {
+        modifiers.Set(index, Intern(env, electron.modifiers[index]));
       }
       obj["modifiers"] = modifiers;
-      obj["code"] = String::New(env, keyString[keyString.size() - 1]);
+      obj["code"] = electron.key_code.empty()
+                        ? CodepointsToString(env, key)
+                        : Intern(env, electron.key_code);
       return obj;
     }
 
@@ -327,41 +1672,259 @@ class InputEventParser final : public tty::EscapeCodeParser {
     return obj;
   };
 
-  static void Callback(Env env, Function callback, void*, Event* event) {
+  Object EventToObject(Env env, const Event& event, bool coalesce) {
     using Type = tty::EscapeCodeParser::Type;
-    if (env != nullptr && callback != nullptr && event != nullptr &&
-        event->type != Type::None) {
-      if (event->type == Type::Unicode) {
-        auto obj = Object::New(env);
-        obj["type"] = Number::New(env, static_cast<int>(Type::Key));
-        obj["event"] =
-            Number::New(env, static_cast<int>(tty::keys::Event::Unicode));
-        obj["code"] = String::New(env, event->string);
-        callback.Call({obj});
-      } else if (event->type != Type::CSI) {
-        auto obj = Object::New(env);
-        obj["type"] = Number::New(env, static_cast<int>(event->type));
-        obj["data"] = String::New(env, event->string);
-        callback.Call({obj});
-      } else {
-        callback.Call({HandleCSI(env, event->string)});
-      }
+    Object obj;
+    if (event.type == Type::Unicode) {
+      obj = Object::New(env);
+      obj["type"] = Number::New(env, static_cast<int>(Type::Key));
+      obj["event"] =
+          Number::New(env, static_cast<int>(tty::keys::Event::Unicode));
+      obj["code"] = Character(env, event.string);
+    } else if (event.type != Type::CSI) {
+      obj = Object::New(env);
+      obj["type"] = Number::New(env, static_cast<int>(event.type));
+      obj["data"] = String::New(env, event.string);
+      if (event.type == Type::Paste)
+        obj["partial"] = Boolean::New(env, event.partial);
+    } else {
+      obj = HandleCSI(env, event.string);
+    }
+    if (coalesce)
+      obj["coalescedCount"] = Number::New(env, event.coalesced);
+    return obj;
+  }
+
+  // Delivers everything queued since the last call, and lets JS read the ring
+  static void Callback(Env env,
+                       Function callback,
+                       InputEventParser* parser,
+                       void*) {
+    if (env == nullptr || callback == nullptr || parser == nullptr)
+      return;
+
+    std::vector<Event> events;
+    {
+      // Cleared before calling back, so that events queued while JS runs
+      // wake it again
+      std::lock_guard<std::mutex> lock(parser->mutex_);
+      events.swap(parser->queue_);
+      parser->notified_ = false;
+    }
+    parser->room_.notify_one();
+    if (parser->ring_)
+      parser->ring_->Sync();
+    parser->Deliver(env, callback, events);
+    // JS reads the ring in the callback
+    parser->Consumed();
+
+    // Checked after the callback, which may have started the listener again,
+    // and only once nothing that was read before the end is left
+    bool ended = false;
+    {
+      std::lock_guard<std::mutex> lock(parser->mutex_);
+      ended = parser->ended_ && parser->queue_.empty();
+      if (ended)
+        parser->ended_ = false;
     }
+    if (ended && parser->on_end_)
+      parser->on_end_(env);
+  }
 
-    if (event != nullptr)
-      delete event;
+  // Calls back with |events|, or an empty array when only the ring has news
+  void Deliver(Env env, Function callback, const std::vector<Event>& events) {
+    using Type = tty::EscapeCodeParser::Type;
+    if (events.empty() && !ring_)
+      return;
+    if (array_) {
+      Array array = Array::New(env);
+      uint32_t length = 0;
+      for (const Event& event : events) {
+        if (event.type != Type::None)
+          array.Set(length++, EventToObject(env, event, coalesce_));
+      }
+      callback.Call({array});
+    } else {
+      for (const Event& event : events) {
+        if (event.type != Type::None)
+          callback.Call({EventToObject(env, event, coalesce_)});
+      }
+    }
   }
 
-  using TSFN = TypedThreadSafeFunction<void, Event, InputEventParser::Callback>;
+  using TSFN = TypedThreadSafeFunction<InputEventParser,
+                                       void,
+                                       InputEventParser::Callback>;
   TSFN callback_;
+  // Runs on the main thread once the listener thread stopped on its own
+  std::function<void(Env)> on_end_;
+  bool array_ = false;
+  bool coalesce_ = false;
+  bool merge_text_ = false;
+  // Parsed from the current read, only touched by the listener thread
+  std::vector<Event> pending_;
+  std::vector<std::array<int32_t, InputRing::kRecordWords>> records_;
+  std::unique_ptr<InputRing> ring_;
+  // Only touched on the main thread
+  std::unordered_map<std::u16string_view, Reference<String>> strings_;
+  std::array<Reference<String>, 128> ascii_;
+
+  // Events waiting for JS, the listener stops reading while there are
+  // |queue_limit_| of them
+  std::mutex mutex_;
+  std::condition_variable room_;
+  std::vector<Event> queue_;
+  size_t queue_limit_;
+  bool notified_ = false;
+  bool interrupted_ = false;
+  bool ended_ = false;
+
+  static bool IsMouseMove(const std::optional<tty::mouse::MouseEvent>& mouse) {
+    return mouse && mouse->type == tty::mouse::Event::Move;
+  }
+
+  static bool IsKeyRepeat(const std::string& csi) {
+    return tty::keys::KeyEventFromCSI(csi).event == tty::keys::Event::Repeat;
+  }
+
+  // Folds |csi| into |last| when both are mouse moves with the same buttons
+  // and modifiers, or repeats of the same key. Only neighbours are merged, so
+  // presses and releases keep their order.
+  static bool Coalesce(Event& last,
+                       const std::string& csi,
+                       uint32_t coalesced = 0) {
+    if (last.type != Type::CSI)
+      return false;
+
+    // Repeats of a key with the same modifiers are identical sequences
+    if (last.string == csi && IsKeyRepeat(csi)) {
+      last.coalesced += coalesced + 1;
+      return true;
+    }
+
+    auto mouse = tty::sgr_mouse::MouseEventFromCSI(csi);
+    if (!IsMouseMove(mouse))
+      return false;
+    auto previous = tty::sgr_mouse::MouseEventFromCSI(last.string);
+    if (!IsMouseMove(previous) || previous->buttons != mouse->buttons ||
+        previous->modifiers != mouse->modifiers)
+      return false;
+
+    // Only the latest position matters
+    last.string = csi;
+    last.coalesced += coalesced + 1;
+    return true;
+  }
+
+  // Same as Coalesce, for records that haven't been published yet
+  static bool CoalesceRecord(int32_t* last, const int32_t* record) {
+    using Type = tty::EscapeCodeParser::Type;
+    if (last == nullptr || last[InputRing::kType] != record[InputRing::kType] ||
+        last[InputRing::kEvent] != record[InputRing::kEvent] ||
+        last[InputRing::kModifiers] != record[InputRing::kModifiers] ||
+        last[InputRing::kKey] != record[InputRing::kKey])
+      return false;
+    if (record[InputRing::kType] == static_cast<int32_t>(Type::Mouse) &&
+        record[InputRing::kEvent] == tty::mouse::Event::Move) {
+      last[InputRing::kX] = record[InputRing::kX];
+      last[InputRing::kY] = record[InputRing::kY];
+    } else if (record[InputRing::kType] != static_cast<int32_t>(Type::Key) ||
+               record[InputRing::kEvent] != tty::keys::Event::Repeat) {
+      return false;
+    }
+    ++last[InputRing::kCoalesced];
+    return true;
+  }
+
+  static bool MergeableRecord(const int32_t* last) {
+    using Type = tty::EscapeCodeParser::Type;
+    if (last == nullptr)
+      return false;
+    if (last[InputRing::kType] == static_cast<int32_t>(Type::Mouse))
+      return last[InputRing::kEvent] == tty::mouse::Event::Move;
+    return last[InputRing::kType] == static_cast<int32_t>(Type::Key) &&
+           last[InputRing::kEvent] == tty::keys::Event::Repeat;
+  }
+
+  // Writes a record for |type| to the ring, returning false when the event
+  // has no binary form and has to be passed to JS as an object
+  bool AppendRecord(Type type, const std::string& csi, uint32_t codepoint) {
+    int32_t record[InputRing::kRecordWords] = {};
+    if (type == Type::Unicode) {
+      record[InputRing::kType] = static_cast<int32_t>(Type::Key);
+      record[InputRing::kEvent] = tty::keys::Event::Unicode;
+      record[InputRing::kKey] = codepoint;
+    } else if (type != Type::CSI) {
+      return false;
+    } else if (auto key = tty::keys::KeyEventFromCSI(csi);
+               key.event != tty::keys::Event::Invalid) {
+      record[InputRing::kType] = static_cast<int32_t>(Type::Key);
+      record[InputRing::kEvent] = key.event;
+      record[InputRing::kModifiers] = key.modifiers;
+      record[InputRing::kKey] = key.key;
+    } else if (auto mouse = tty::sgr_mouse::MouseEventFromCSI(csi)) {
+      record[InputRing::kType] = static_cast<int32_t>(Type::Mouse);
+      record[InputRing::kEvent] = mouse->type;
+      record[InputRing::kModifiers] = mouse->modifiers;
+      record[InputRing::kKey] = mouse->buttons;
+      record[InputRing::kX] = mouse->x;
+      record[InputRing::kY] = mouse->y;
+    } else {
+      return false;
+    }
+
+    if (coalesce_ && !records_.empty() &&
+        CoalesceRecord(records_.back().data(), record))
+      return true;
+    records_.emplace_back();
+    std::copy(std::begin(record), std::end(record), records_.back().begin());
+    return true;
+  }
 
  protected:
   bool Handle(Type type, const std::string& data) override {
-    callback_.BlockingCall(new Event(type, data));
+    if (ring_ && AppendRecord(type, data, 0))
+      return true;
+    if (coalesce_ && type == Type::CSI && !pending_.empty() &&
+        Coalesce(pending_.back(), data))
+      return true;
+    pending_.emplace_back(type, data);
     return true;
   };
 
+  // A bracketed paste is one event, or a few for huge ones
+  bool HandlePaste(std::string_view text, bool last) override {
+    Event& event = pending_.emplace_back(Type::Paste, text);
+    event.partial = !last;
+    return true;
+  }
+
+  // Text that arrives at once is still one event or record per character,
+  // unless merge_text_ asks for one event per run. The ring keeps one record
+  // per character so that text stays in order with keys.
+  bool HandleText(std::string_view text) override {
+    // Records hold codepoints, which the default decodes
+    if (ring_)
+      return EscapeCodeParser::HandleText(text);
+    if (merge_text_) {
+      pending_.emplace_back(Type::Unicode, text);
+      return true;
+    }
+    // The run is valid UTF-8, so it's split at lead bytes rather than decoded
+    // and encoded again, and every character fits in the string's own buffer
+    size_t start = 0;
+    for (size_t i = 1; i <= text.size(); ++i) {
+      if (i == text.size() || (static_cast<uint8_t>(text[i]) & 0xc0) != 0x80) {
+        pending_.emplace_back(Type::Unicode, text.substr(start, i - start));
+        start = i;
+      }
+    }
+    return true;
+  }
+
   bool HandleUTF8Codepoint(uint32_t codepoint) override {
+    if (ring_ && AppendRecord(Type::Unicode, {}, codepoint))
+      return true;
     std::string result;
     if (codepoint <= 0x7F) {
       // Handle ASCII characters (0-127)
@@ -382,56 +1945,515 @@ class InputEventParser final : public tty::EscapeCodeParser {
       result.push_back(static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F)));
       result.push_back(static_cast<char>(0x80 | (codepoint & 0x3F)));
     }
-    callback_.BlockingCall(
-        new Event(tty::EscapeCodeParser::Type::Unicode, result));
+    pending_.emplace_back(tty::EscapeCodeParser::Type::Unicode, result);
     return true;
   }
 
  public:
-  explicit InputEventParser(const CallbackInfo& info) {
+  InputEventParser(bool array,
+                   bool coalesce,
+                   bool merge_text,
+                   size_t queue_limit)
+      : array_(array),
+        coalesce_(coalesce),
+        merge_text_(merge_text),
+        queue_limit_(queue_limit) {}
+
+  // The callback shares ownership of the parser, so that calls to it that are
+  // still on their way when it's released can run
+  static std::shared_ptr<InputEventParser> Create(const CallbackInfo& info,
+                                                  bool array,
+                                                  bool coalesce,
+                                                  bool merge_text,
+                                                  size_t queue_limit) {
+    auto parser = std::make_shared<InputEventParser>(array, coalesce,
+                                                     merge_text, queue_limit);
     // clang-format off
-    callback_ = TSFN::New(
+    parser->callback_ = TSFN::New(
 				info.Env(),
 				info[0].As<Function>(),
 				Object::New(info.Env()),
 				"InputParserCallback",
 				0,
-				1
+				1,
+				parser.get(),
+				[](Napi::Env, std::shared_ptr<InputEventParser>* owner,
+				   InputEventParser*) { delete owner; },
+				new std::shared_ptr<InputEventParser>(parser)
 		);
     // clang-format on
+    return parser;
+  }
+
+  // Writes key and mouse events to a ring of |capacity| records instead of
+  // creating objects for them, the rest are passed to the callback in an array
+  void EnableRing(Napi::Env env, uint32_t capacity) {
+    ring_ = std::make_unique<InputRing>(env, capacity);
+    array_ = true;
+  }
+
+  // Queues the events parsed since the last flush for JS, waking the main
+  // thread if it isn't already on its way. Waits for JS to make room when the
+  // queue is full, returning false if interrupted while waiting.
+  bool Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const bool published = !records_.empty();
+    if (published && !FlushRecords(lock))
+      return false;
+    if (!pending_.empty()) {
+      room_.wait(lock,
+                 [this] { return queue_.size() < queue_limit_ || interrupted_; });
+      if (interrupted_)
+        return false;
+      for (Event& event : pending_) {
+        if (coalesce_ && event.type == Type::CSI && !queue_.empty() &&
+            Coalesce(queue_.back(), event.string, event.coalesced))
+          continue;
+        queue_.push_back(std::move(event));
+      }
+      pending_.clear();
+    } else if (!published) {
+      return true;
+    }
+    Notify();
+    return true;
+  }
+
+  // Wakes the main thread unless it's already on its way, with mutex_ held
+  void Notify() {
+    if (!notified_) {
+      notified_ = true;
+      callback_.NonBlockingCall();
+    }
+  }
+
+  // Copies the records parsed since the last flush to the ring and publishes
+  // them. When the ring is full, what fits is published and the listener
+  // waits for JS to read, keeping the rest if interrupted while waiting.
+  bool FlushRecords(std::unique_lock<std::mutex>& lock) {
+    size_t copied = 0;
+    for (; copied < records_.size(); ++copied) {
+      if (ring_->Full()) {
+        ring_->Publish();
+        Notify();
+        // Signaled after the callback returns, or by consumed when JS reads
+        // at any other time
+        room_.wait(lock, [this] { return !ring_->Full() || interrupted_; });
+        if (interrupted_)
+          break;
+      }
+      ring_->Append(records_[copied].data());
+    }
+    records_.erase(records_.begin(), records_.begin() + copied);
+    ring_->Publish();
+    return records_.empty();
+  }
+
+  // Lets a Flush that waits for room in the ring go on once JS read it, on
+  // the main thread
+  void Consumed() {
+    if (!ring_)
+      return;
+    bool room;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      room = ring_->Consume();
+    }
+    if (room)
+      room_.notify_one();
+  }
+
+  // Stops a Flush from waiting for room, until Resume
+  void Interrupt() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    interrupted_ = true;
+    room_.notify_all();
+  }
+
+  void Resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    interrupted_ = false;
+    ended_ = false;
+  }
+
+  // Tells the main thread that the listener thread stopped on its own, after
+  // the events that were flushed before
+  void End() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ended_ = true;
+    Notify();
+  }
+
+  // Only set and called on the main thread
+  void OnEnd(std::function<void(Env)> on_end) { on_end_ = std::move(on_end); }
+
+  // Forgets events that weren't delivered and any partial escape code, only
+  // while the listener thread isn't running
+  void Discard() {
+    pending_.clear();
+    records_.clear();
+    Reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.clear();
+  }
+
+  // Keeps the event loop alive while listening
+  void Ref(Napi::Env env) { callback_.Ref(env); }
+  void Unref(Napi::Env env) { callback_.Unref(env); }
+
+  // Lets the callback go once calls that are on their way have run
+  void Release() { callback_.Release(); }
+
+  InputRing* ring() const { return ring_.get(); }
+
+  // Whether the last event could still absorb the events that follow it
+  bool Mergeable() const {
+    if (coalesce_ && !records_.empty() &&
+        MergeableRecord(records_.back().data()))
+      return true;
+    if (!coalesce_ || pending_.empty() || pending_.back().type != Type::CSI)
+      return false;
+    const std::string& csi = pending_.back().string;
+    return IsMouseMove(tty::sgr_mouse::MouseEventFromCSI(csi)) ||
+           IsKeyRepeat(csi);
   }
 };
 
-Value ListenForInput(const CallbackInfo& info) {
-  Env env = info.Env();
-  int wait = 10;
-  if (info.Length() > 1 && info[1].IsNumber()) {
-    wait = info[1].As<Number>().Int32Value();
+struct ListenOptions {
+  bool batch = false;
+  bool coalesce = false;
+  bool mergeText = false;
+  int coalesceLatency = 0;
+  uint32_t queueSize = 1024;
+  // Records in the ring, 0 without one
+  uint32_t ring = 0;
+  // Called when the listener stops on its own
+  Function onEnd;
+};
+
+static ListenOptions GetListenOptions(const CallbackInfo& info) {
+  ListenOptions result;
+  // The interval that used to be passed is no longer needed, input is read
+  // as soon as it arrives
+  if (info.Length() > 1 && info[1].IsObject()) {
+    Object options = info[1].As<Object>();
+    if (options.Has("batch") && options.Get("batch").IsBoolean()) {
+      result.batch = options.Get("batch").As<Boolean>().Value();
+    }
+    if (options.Has("coalesce") && options.Get("coalesce").IsBoolean()) {
+      result.coalesce = options.Get("coalesce").As<Boolean>().Value();
+    }
+    if (options.Has("mergeText") && options.Get("mergeText").IsBoolean()) {
+      result.mergeText = options.Get("mergeText").As<Boolean>().Value();
+    }
+    if (options.Has("coalesceLatency") &&
+        options.Get("coalesceLatency").IsNumber()) {
+      result.coalesceLatency = std::max(
+          0, options.Get("coalesceLatency").As<Number>().Int32Value());
+    }
+    if (options.Has("queueSize") && options.Get("queueSize").IsNumber()) {
+      result.queueSize =
+          std::max(1, options.Get("queueSize").As<Number>().Int32Value());
+    }
+    if (options.Has("ring") && options.Get("ring").IsNumber()) {
+      result.ring = std::max(0, options.Get("ring").As<Number>().Int32Value());
+    }
+    if (options.Has("onEnd") && options.Get("onEnd").IsFunction()) {
+      result.onEnd = options.Get("onEnd").As<Function>();
+    }
+  }
+  return result;
+}
+
+// Reads and parses input on its own thread while started, waking only when
+// there's input. Stopping joins the thread, and closing releases the callback.
+class InputListener : public ObjectWrap<InputListener> {
+ public:
+  static Object Init(Napi::Env env, Object exports) {
+    Function func = DefineClass(
+        env, "InputListener",
+        {InstanceMethod("start", &InputListener::Start),
+         InstanceMethod("pause", &InputListener::Pause),
+         InstanceMethod("stop", &InputListener::Stop),
+         InstanceMethod("close", &InputListener::Close),
+         InstanceMethod("consumed", &InputListener::Consumed),
+         InstanceAccessor("listening", &InputListener::Listening, nullptr),
+         InstanceAccessor("ring", &InputListener::Ring, nullptr)});
+
+    env.GetInstanceData<Constructors>()->inputListener = Persistent(func);
+
+    exports.Set("InputListener", func);
+    return exports;
+  }
+
+  InputListener(const CallbackInfo& info) : ObjectWrap<InputListener>(info) {
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsFunction()) {
+      TypeError::New(env, "Expected a callback and optionally options")
+          .ThrowAsJavaScriptException();
+      return;
+    }
+
+    ListenOptions options = GetListenOptions(info);
+    coalesceLatency = options.coalesceLatency;
+    parser = InputEventParser::Create(info, options.batch, options.coalesce,
+                                      options.mergeText, options.queueSize);
+    if (options.ring > 0)
+      parser->EnableRing(env, options.ring);
+    if (!options.onEnd.IsEmpty())
+      onEnd = Persistent(options.onEnd);
+    parser->OnEnd([this](Napi::Env env) { Ended(env); });
+    // Only keeps the process alive while started
+    parser->Unref(env);
+  }
+
+  ~InputListener() {
+    if (parser != nullptr) {
+      Halt();
+      parser->OnEnd(nullptr);
+      parser->Release();
+    }
+  }
+
+  // Starts or resumes reading input
+  Napi::Value Start(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (parser == nullptr) {
+      Error::New(env, "InputListener is closed").ThrowAsJavaScriptException();
+      return env.Undefined();
+    }
+    if (listening)
+      return env.Undefined();
+
+    // The thread might have stopped on its own before it was paused
+    if (thread.joinable())
+      thread.join();
+    waiter.Reset();
+    parser->Resume();
+    parser->Ref(env);
+    Ref();
+    listening = true;
+    thread = std::thread(&InputListener::Run, this);
+    return env.Undefined();
+  }
+
+  // Stops reading input, keeping events that were read but not delivered and
+  // any partial escape code for when it's started again
+  Napi::Value Pause(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (listening) {
+      Halt();
+      parser->Unref(env);
+      Unref();
+      listening = false;
+    }
+    return env.Undefined();
+  }
+
+  // Stops reading input and forgets events that weren't delivered
+  Napi::Value Stop(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Pause(info);
+    if (parser != nullptr)
+      parser->Discard();
+    return env.Undefined();
+  }
+
+  // Stops and releases the callback, the listener can't be started afterwards
+  Napi::Value Close(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Stop(info);
+    if (parser != nullptr) {
+      parser->OnEnd(nullptr);
+      parser->Release();
+      parser.reset();
+    }
     return env.Undefined();
   }
-  auto* parser = new InputEventParser(info);
-  std::thread([wait, parser]() {
-    while (!s_quit) {
-      if (!tty::in::WaitForReady(wait)) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+
+  Napi::Value Listening(const CallbackInfo& info) {
+    return Boolean::New(info.Env(), listening);
+  }
+
+  Napi::Value Ring(const CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (parser == nullptr || parser->ring() == nullptr)
+      return env.Undefined();
+    return parser->ring()->buffer();
+  }
+
+  // For JS that reads the ring outside of the callback, so that a listener
+  // waiting for room goes on without waiting for the next callback
+  Napi::Value Consumed(const CallbackInfo& info) {
+    if (parser != nullptr)
+      parser->Consumed();
+    return info.Env().Undefined();
+  }
+
+ private:
+  void Run() {
+    using Clock = std::chrono::steady_clock;
+    using Result = tty::in::Waiter::Result;
+    // Events parsed before a pause are delivered now, rather than after the
+    // next read
+    if (!parser->Flush())
+      return;
+    Result result;
+    bool closed = false;
+    while (!closed && (result = waiter.Wait()) != Result::Woken &&
+           result != Result::Closed) {
+      if (result != Result::Ready)
         continue;
+      // End of file or an error, which a regular file or a hung up terminal
+      // keep reporting as ready
+      std::optional<std::string_view> input =
+          tty::in::Read(buffer.data(), buffer.size());
+      if (!input) {
+        closed = true;
+        break;
+      }
+      parser->Parse(*input);
+
+      // Holds on to a move or repeat for up to the latency, in case the next
+      // read continues it
+      const auto deadline =
+          Clock::now() + std::chrono::milliseconds(coalesceLatency);
+      while (parser->Mergeable()) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - Clock::now());
+        if (remaining.count() <= 0 ||
+            waiter.Wait(remaining.count()) != Result::Ready)
+          break;
+        input = tty::in::Read(buffer.data(), buffer.size());
+        if (!input) {
+          closed = true;
+          break;
+        }
+        parser->Parse(*input);
       }
-      parser->Parse(tty::in::Read());
+      if (!parser->Flush())
+        return;
+    }
+    // Stopped by stdin rather than Halt
+    if ((closed || result == Result::Closed) && parser->Flush())
+      parser->End();
+  }
+
+  // The thread stopped on its own, at the end of stdin or on an error, which
+  // releases what start held unless it was paused in the meantime
+  void Ended(Napi::Env env) {
+    if (!listening)
+      return;
+    if (thread.joinable())
+      thread.join();
+    parser->Unref(env);
+    listening = false;
+    if (!onEnd.IsEmpty())
+      onEnd.Value().Call(Value(), {});
+    Unref();
+  }
+
+  // Wakes the thread, including from waiting for room in the queue, and
+  // waits for it to finish
+  void Halt() {
+    waiter.Wake();
+    parser->Interrupt();
+    if (thread.joinable())
+      thread.join();
+  }
+
+  // Shared with its callback, null once closed
+  std::shared_ptr<InputEventParser> parser;
+  tty::in::Waiter waiter;
+  std::thread thread;
+  // Only touched by the thread
+  std::array<char, tty::in::kReadSize> buffer;
+  FunctionReference onEnd;
+  int coalesceLatency = 0;
+  bool listening = false;
+};
+
+// Creates and starts an InputListener for the functions that predate it
+static Object StartListener(const CallbackInfo& info, Object options) {
+  Object listener =
+      info.Env().GetInstanceData<Constructors>()->inputListener.New(
+          {info[0], options});
+  if (!info.Env().IsExceptionPending())
+    listener.Get("start").As<Function>().Call(listener, {});
+  return listener;
+}
+
+// The listener's close method, as the cancel callback
+static Function BoundClose(Object listener) {
+  Function close = listener.Get("close").As<Function>();
+  return close.Get("bind").As<Function>().Call(close, {listener}).As<Function>();
+}
+
+Value ListenForInput(const CallbackInfo& info) {
+  Env env = info.Env();
+  Object options = info.Length() > 1 && info[1].IsObject()
+                       ? info[1].As<Object>()
+                       : Object::New(env);
+  Object listener = StartListener(info, options);
+  if (env.IsExceptionPending())
+    return env.Undefined();
+  return BoundClose(listener);
+}
+
+Value ListenForInputRing(const CallbackInfo& info) {
+  Env env = info.Env();
+  Object options = Object::New(env);
+  uint32_t capacity = 1024;
+  if (info.Length() > 1 && info[1].IsObject()) {
+    Object given = info[1].As<Object>();
+    for (const char* key :
+         {"coalesce", "coalesceLatency", "queueSize", "onEnd"}) {
+      if (given.Has(key))
+        options.Set(key, given.Get(key));
     }
-    // delete parser;
-  }).detach();
-  return Napi::Function::New(env, [](const CallbackInfo&) { s_quit = true; });
+    if (given.Has("capacity") && given.Get("capacity").IsNumber())
+      capacity = std::max(1, given.Get("capacity").As<Number>().Int32Value());
+  }
+  options["ring"] = Number::New(env, capacity);
+  Object listener = StartListener(info, options);
+  if (env.IsExceptionPending())
+    return env.Undefined();
+
+  Object result = Object::New(env);
+  result["buffer"] = listener.Get("ring");
+  result["cancel"] = BoundClose(listener);
+  Function consumed = listener.Get("consumed").As<Function>();
+  result["consumed"] =
+      consumed.Get("bind").As<Function>().Call(consumed, {listener});
+  return result;
 }
 
 Object Init(Env env, Object exports) {
+  // Picks the pixel kernels for this CPU up front
+  graphics::ActiveIsa();
+  // Freed with the env
+  env.SetInstanceData(new Constructors());
+
   // Initialize the ShmGraphicBuffer class
   ShmGraphicBuffer::Init(env, exports);
+  ShmGraphicBufferRing::Init(env, exports);
+  ShmTileCache::Init(env, exports);
+  FrameDiff::Init(env, exports);
+  KittyGraphicsEncoder::Init(env, exports);
+  InputListener::Init(env, exports);
 
+  exports.Set(String::New(env, "getCpuFeatures"),
+              Function::New(env, GetCpuFeatures));
+  exports.Set(String::New(env, "setStreamingThreshold"),
+              Function::New(env, SetStreamingThreshold));
   exports.Set(String::New(env, "setupInput"), Function::New(env, SetupInput));
   exports.Set(String::New(env, "cleanupInput"),
               Function::New(env, CleanupInput));
   exports.Set(String::New(env, "listenForInput"),
               Function::New(env, ListenForInput));
+  exports.Set(String::New(env, "listenForInputRing"),
+              Function::New(env, ListenForInputRing));
   return exports;
 }
 
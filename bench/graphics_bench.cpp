@@ -0,0 +1,258 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+// Measures the native graphics path without Node, printing JSON to stdout.
+// The kernels are picked once per process, so compare them by running with
+// AWRIT_NATIVE_ISA set, which bench/run.mjs does for every supported one.
+//
+//   graphics-bench [--quick] [--filter name] [--time ms]
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "graphics/cpu_features.h"
+#include "graphics/frame_diff.h"
+#include "graphics/kitty_graphics.h"
+#include "graphics/scale.h"
+#include "graphics/shm_segment.h"
+#include "graphics/swizzle.h"
+#include "graphics/tile_cache.h"
+#include "graphics/worker_pool.h"
+
+using namespace graphics;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Resolution {
+  const char* name;
+  Size size;
+};
+
+constexpr Resolution kResolutions[] = {
+    {"720p", {1280, 720}}, {"1080p", {1920, 1080}}, {"1440p", {2560, 1440}},
+    {"4k", {3840, 2160}},  {"5k", {5120, 2880}},
+};
+
+struct Options {
+  bool quick = false;
+  std::string filter;
+  double seconds = 0.25;
+};
+
+struct Case {
+  std::string name;
+  const char* resolution;
+  Size size;
+  Rect rect;
+  // Pixel bytes read per iteration, for throughput
+  size_t bytes;
+  const char* mapping;
+};
+
+bool first_result = true;
+
+void Report(const Case& c, std::vector<double>& micros) {
+  std::sort(micros.begin(), micros.end());
+  auto percentile = [&](double p) {
+    size_t index = std::min(micros.size() - 1,
+                            static_cast<size_t>(p * micros.size()));
+    return micros[index];
+  };
+  double p50 = percentile(0.5);
+  std::printf(
+      "%s\n    {\"name\": \"%s\", \"resolution\": \"%s\", \"width\": %u, "
+      "\"height\": %u, \"rect\": [%u, %u, %u, %u], \"mapping\": \"%s\", "
+      "\"iterations\": %zu, \"gbps\": %.3f, \"p50_us\": %.1f, "
+      "\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+      first_result ? "" : ",", c.name.c_str(), c.resolution, c.size.width,
+      c.size.height, c.rect.x, c.rect.y, c.rect.width, c.rect.height,
+      c.mapping, micros.size(), c.bytes / (p50 * 1e3), p50, percentile(0.9),
+      percentile(0.99), micros.back());
+  first_result = false;
+  std::fflush(stdout);
+}
+
+// Runs |body| until |options.seconds| have passed, after a few warm up runs
+void Measure(const Options& options,
+             const Case& c,
+             const std::function<void()>& body,
+             const std::function<void()>& setup = nullptr) {
+  if (!options.filter.empty() &&
+      c.name.find(options.filter) == std::string::npos)
+    return;
+
+  constexpr size_t kWarmup = 3;
+  constexpr size_t kMinIterations = 10;
+  constexpr size_t kMaxIterations = 5000;
+  std::vector<double> micros;
+  Clock::time_point end =
+      Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double>(options.seconds));
+  for (size_t i = 0; i < kWarmup + kMaxIterations; ++i) {
+    if (setup)
+      setup();
+    Clock::time_point start = Clock::now();
+    body();
+    Clock::time_point done = Clock::now();
+    if (i >= kWarmup)
+      micros.push_back(
+          std::chrono::duration<double, std::micro>(done - start).count());
+    if (micros.size() >= kMinIterations && done > end)
+      break;
+  }
+  Report(c, micros);
+}
+
+void Fill(std::vector<char>& frame) {
+  uint32_t state = 0x12345678;
+  for (char& byte : frame) {
+    state = state * 1664525 + 1013904223;
+    byte = static_cast<char>(state >> 24);
+  }
+}
+
+void Run(const Options& options, const Resolution& resolution) {
+  const Size size = resolution.size;
+  const Rect frame{0, 0, size.width, size.height};
+  const size_t stride = size.width * BYTES_PER_PIXEL;
+  const size_t bytes = frame_bytes(size);
+  const char* name = resolution.name;
+
+  std::vector<char> src(bytes);
+  Fill(src);
+
+  const std::string shm_name = "/awrit-bench-" + std::to_string(getpid());
+  ShmSegment warm(shm_name);
+  if (warm.Map(frame_size(size), true) != ShmSegment::Status::Ok) {
+    std::fprintf(stderr, "failed to map shared memory\n");
+    std::exit(1);
+  }
+  char* dst = warm.data();
+
+  Measure(options, {"swizzle", name, size, frame, bytes, "warm"},
+          [&] { SwizzleRect(src.data(), stride, dst, size, frame); });
+
+  // A new mapping for every frame, as without the persistent option
+  ShmSegment cold(shm_name + "-cold");
+  Measure(
+      options, {"swizzle", name, size, frame, bytes, "cold"},
+      [&] {
+        cold.Map(frame_size(size), false);
+        SwizzleRect(src.data(), stride, cold.data(), size, frame);
+      },
+      [&] { cold.Close(); });
+  cold.Close();
+
+  Measure(options, {"swizzle_rgb", name, size, frame, bytes, "warm"}, [&] {
+    SwizzleRect(src.data(), stride, dst, size, frame, PixelFormat::RGB);
+  });
+
+  Measure(options, {"swizzle_parallel", name, size, frame, bytes, "warm"},
+          [&] {
+            SwizzleRectParallel(WorkerPool::Shared(), src.data(), stride, dst,
+                                size, frame);
+          });
+
+  std::vector<uint64_t> hashes(size.height);
+  Measure(options, {"swizzle_hash_rows", name, size, frame, bytes, "warm"},
+          [&] {
+            SwizzleRect(src.data(), stride, dst, size, frame,
+                        PixelFormat::RGBA, hashes.data());
+          });
+
+  // Dirty rects of a few sizes, at aligned and unaligned columns
+  for (uint32_t side : {64u, 256u, 1024u}) {
+    if (options.quick && side != 256)
+      continue;
+    for (uint32_t x : {0u, 1u, 3u}) {
+      Rect rect = ClampRect({size.width / 3 + x, size.height / 3, side, side},
+                            size);
+      Measure(options,
+              {"swizzle_rect", name, size, rect, rect.area() * 4, "warm"},
+              [&] { SwizzleRect(src.data(), stride, dst, size, rect); });
+    }
+  }
+
+  // Halving has its own kernels, the other ratios take the separable path
+  struct Ratio {
+    const char* op;
+    uint32_t num;
+    uint32_t den;
+  };
+  for (Ratio ratio : {Ratio{"scale_half", 1, 2}, Ratio{"scale_4_5", 4, 5},
+                      Ratio{"scale_2_3", 2, 3}, Ratio{"scale_1_3", 1, 3}}) {
+    if (options.quick && ratio.den == 5)
+      continue;
+    const Size target{size.width * ratio.num / ratio.den,
+                      size.height * ratio.num / ratio.den};
+    Measure(options, {ratio.op, name, size, frame, bytes, "warm"}, [&] {
+      SwizzleScaleRect(src.data(), stride, size, dst, target,
+                       {0, 0, target.width, target.height});
+    });
+  }
+
+  std::vector<char> encoded(kitty::MaxEncodedSize(frame, "a=T,i=1,q=2"));
+  Measure(options, {"kitty_encode", name, size, frame, bytes, "warm"}, [&] {
+    kitty::Encode(src.data(), size, frame, "a=T,i=1,q=2", encoded.data());
+  });
+
+  FrameDiff diff;
+  diff.Diff(src.data(), size, frame);
+  Measure(options, {"frame_diff_same", name, size, frame, bytes, "warm"},
+          [&] { diff.Diff(src.data(), size, frame); });
+
+  TileCache tiles(64, 4096, 1);
+  std::vector<char> tile_segment(tiles.SegmentSize(size));
+  Measure(options, {"tile_cache", name, size, frame, bytes, "warm"}, [&] {
+    for (const auto& tile :
+         tiles.Write(src.data(), stride, size, frame, tile_segment.data())) {
+      if (tile.fresh)
+        tiles.Confirm(tile.id, true);
+    }
+  });
+
+  warm.Close();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--quick") == 0) {
+      options.quick = true;
+    } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (std::strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+      options.seconds = std::atof(argv[++i]) / 1000;
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--quick] [--filter name] [--time ms]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+
+  std::printf("{\n  \"kernel\": \"%s\",\n  \"streamingThreshold\": %zu,\n"
+              "  \"results\": [",
+              IsaName(ActiveIsa()), StreamingThreshold());
+  for (const Resolution& resolution : kResolutions) {
+    if (options.quick && resolution.size.width != 1920 &&
+        resolution.size.width != 3840)
+      continue;
+    Run(options, resolution);
+  }
+  std::printf("\n  ]\n}\n");
+  return 0;
+}
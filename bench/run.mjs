@@ -0,0 +1,178 @@
+// Benchmarks ShmGraphicBuffer from Node, including argument marshalling, and
+// how much writing frames delays the event loop with and without streaming
+// stores, then runs the native graphics-bench once for every kernel the CPU
+// supports.
+// Prints JSON to stdout so that runs can be compared across commits.
+//
+//   npm run bench:build && npm run bench [-- --quick] [-- --time ms]
+import { execFileSync } from "node:child_process";
+import { existsSync } from "node:fs";
+import { createRequire } from "node:module";
+import { dirname, join } from "node:path";
+import { monitorEventLoopDelay } from "node:perf_hooks";
+import { fileURLToPath } from "node:url";
+
+const __dirname = dirname(fileURLToPath(import.meta.url));
+const root = join(__dirname, "..");
+const native = createRequire(import.meta.url)(root);
+
+const args = process.argv.slice(2);
+const quick = args.includes("--quick");
+const timeIndex = args.indexOf("--time");
+const time = timeIndex >= 0 ? Number(args[timeIndex + 1]) : 250;
+
+const resolutions = [
+  ["720p", 1280, 720],
+  ["1080p", 1920, 1080],
+  ["1440p", 2560, 1440],
+  ["4k", 3840, 2160],
+  ["5k", 5120, 2880],
+].filter(([name]) => !quick || name === "1080p" || name === "4k");
+
+function summarize(micros) {
+  micros.sort((a, b) => a - b);
+  const at = (p) => micros[Math.min(micros.length - 1, Math.floor(p * micros.length))];
+  return {
+    iterations: micros.length,
+    p50_us: at(0.5),
+    p90_us: at(0.9),
+    p99_us: at(0.99),
+    max_us: micros[micros.length - 1],
+  };
+}
+
+async function measure(body) {
+  const micros = [];
+  for (let i = 0; i < 3; ++i) await body();
+  const end = performance.now() + time;
+  while (micros.length < 10 || (performance.now() < end && micros.length < 5000)) {
+    const start = performance.now();
+    await body();
+    micros.push((performance.now() - start) * 1000);
+  }
+  return summarize(micros);
+}
+
+async function benchWrite() {
+  const results = [];
+  const name = `/awrit-bench-node-${process.pid}`;
+  for (const [resolution, width, height] of resolutions) {
+    const frame = Buffer.alloc(width * height * 4, 0x7f);
+    const size = { width, height };
+    const rects = [
+      { x: 0, y: 0, width, height },
+      { x: width >> 2, y: height >> 2, width: 256, height: 256 },
+    ];
+    for (const persistent of [true, false]) {
+      const buffer = new native.ShmGraphicBuffer(name, { persistent });
+      for (const rect of rects) {
+        const common = {
+          resolution,
+          width,
+          height,
+          rect: [rect.x, rect.y, rect.width, rect.height],
+          mapping: persistent ? "warm" : "cold",
+        };
+        results.push({
+          name: "write",
+          ...common,
+          ...(await measure(() => buffer.write(frame, size, rect))),
+        });
+        results.push({
+          name: "writeAsync",
+          ...common,
+          ...(await measure(() => buffer.writeAsync(frame, size, rect))),
+        });
+      }
+      buffer.close();
+    }
+  }
+  return results;
+}
+
+// Writes whole frames at 60 fps while sampling the event loop's delay every
+// millisecond, once with the default streaming threshold and once with
+// streaming stores turned off
+async function benchEventLoop() {
+  const results = [];
+  const name = `/awrit-bench-loop-${process.pid}`;
+  const threshold = native.setStreamingThreshold();
+  const frameInterval = 1000 / 60;
+  for (const [resolution, width, height] of resolutions) {
+    const frame = Buffer.alloc(width * height * 4, 0x7f);
+    const size = { width, height };
+    const buffer = new native.ShmGraphicBuffer(name, { persistent: true });
+    for (const streaming of [true, false]) {
+      native.setStreamingThreshold(streaming ? threshold : 0);
+      for (const method of ["write", "writeAsync"]) {
+        await buffer[method](frame, size);
+        const delay = monitorEventLoopDelay({ resolution: 1 });
+        delay.enable();
+        let frames = 0;
+        const end = performance.now() + time * 4;
+        while (performance.now() < end) {
+          await buffer[method](frame, size);
+          await new Promise((resolve) => setTimeout(resolve, frameInterval));
+          ++frames;
+        }
+        delay.disable();
+        // The histogram is in nanoseconds
+        results.push({
+          name: "eventLoopDelay",
+          resolution,
+          width,
+          height,
+          method,
+          streaming,
+          frames,
+          p50_us: delay.percentile(50) / 1e3,
+          p99_us: delay.percentile(99) / 1e3,
+          max_us: delay.max / 1e3,
+        });
+      }
+    }
+    buffer.close();
+  }
+  native.setStreamingThreshold(threshold);
+  return results;
+}
+
+// Runs the native bench under every kernel, when it was built
+function benchNative() {
+  const bench = join(root, "build", "Release", "graphics-bench");
+  if (!existsSync(bench)) return null;
+
+  const features = native.getCpuFeatures();
+  const kernels = ["scalar", "ssse3", "avx2", "avx512bw", "neon"].filter(
+    (kernel) => kernel === "scalar" || features[kernel],
+  );
+  const benchArgs = ["--time", String(time)];
+  if (quick) benchArgs.push("--quick");
+
+  const results = {};
+  for (const kernel of kernels) {
+    const output = execFileSync(bench, benchArgs, {
+      env: { ...process.env, AWRIT_NATIVE_ISA: kernel },
+      encoding: "utf8",
+      maxBuffer: 64 * 1024 * 1024,
+    });
+    results[kernel] = JSON.parse(output).results;
+  }
+  return results;
+}
+
+let commit = null;
+try {
+  commit = execFileSync("git", ["rev-parse", "HEAD"], { cwd: root, encoding: "utf8" }).trim();
+} catch {}
+
+const report = {
+  commit,
+  node: process.version,
+  cpu: native.getCpuFeatures(),
+  streamingThreshold: native.setStreamingThreshold(),
+  write: await benchWrite(),
+  eventLoop: await benchEventLoop(),
+  native: benchNative(),
+};
+process.stdout.write(JSON.stringify(report, null, 2) + "\n");
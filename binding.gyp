@@ -8,6 +8,19 @@
         "tty/kitty_keys.cpp",
         "tty/sgr_mouse.cpp",
         "string/string_utils.cpp",
+        "graphics/cpu_features.cpp",
+        "graphics/deflate.cpp",
+        "graphics/frame_diff.cpp",
+        "graphics/frame_stats.cpp",
+        "graphics/hash.cpp",
+        "graphics/kitty_graphics.cpp",
+        "graphics/rect.cpp",
+        "graphics/scale.cpp",
+        "graphics/scroll.cpp",
+        "graphics/shm_segment.cpp",
+        "graphics/swizzle.cpp",
+        "graphics/tile_cache.cpp",
+        "graphics/worker_pool.cpp",
         "third_party/utf8_decode.cpp",
         "awrit-native.cpp",
       ],
@@ -25,11 +38,12 @@
       "conditions": [
         ['NAPI_VERSION!=""', { 'defines': ['NAPI_VERSION=<@(NAPI_VERSION)'] } ],
         ["OS == 'linux'", {
-          "libraries": ["-lrt"],
-          "cflags+": ["-mavx2", "-mssse3", "-std=c++17"],
-          "cflags_cc+": ["-mavx2", "-mssse3", "-std=c++17"]
+          "libraries": ["-lrt", "-lz"],
+          "cflags+": ["-std=c++17"],
+          "cflags_cc+": ["-std=c++17"]
         }],
         ["OS == 'mac'", {
+          "libraries": ["-lz"],
           "cflags+": ["-fvisibility=hidden", "-std=c++17" ],
           "xcode_settings": {
             # -fvisibility=hidden
@@ -52,7 +66,7 @@
 
             # Build universal binary to support M1 (Apple silicon)
             "OTHER_CFLAGS": [
-              "-arch x86_64", "-mavx2", "-mssse3",
+              "-arch x86_64",
               "-arch arm64", "-ftree-vectorize"
             ],
             "OTHER_LDFLAGS": [
@@ -63,5 +77,48 @@
         }],
       ]
     },
+  ],
+  "variables": {
+    # node-gyp rebuild -- -Dbuild_bench=1, see bench/run.mjs
+    "build_bench%": 0,
+  },
+  "conditions": [
+    ["build_bench==1", {
+      "targets": [
+        {
+          "target_name": "graphics-bench",
+          "type": "executable",
+          "sources": [
+            "graphics/cpu_features.cpp",
+            "graphics/frame_diff.cpp",
+            "graphics/frame_stats.cpp",
+            "graphics/hash.cpp",
+            "graphics/kitty_graphics.cpp",
+            "graphics/rect.cpp",
+            "graphics/scale.cpp",
+            "graphics/shm_segment.cpp",
+            "graphics/swizzle.cpp",
+            "graphics/tile_cache.cpp",
+            "graphics/worker_pool.cpp",
+            "bench/graphics_bench.cpp",
+          ],
+          "include_dirs": [ "." ],
+          "cflags_cc!": [ "-fno-exceptions", "-std=c++17" ],
+          "conditions": [
+            ["OS == 'linux'", {
+              "libraries": ["-lrt", "-lpthread"],
+              "cflags_cc+": ["-std=c++17"]
+            }],
+            ["OS == 'mac'", {
+              "xcode_settings": {
+                "CLANG_CXX_LANGUAGE_STANDARD": "gnu++17",
+                "CLANG_CXX_LIBRARY": "libc++",
+                "MACOSX_DEPLOYMENT_TARGET": "10.15"
+              }
+            }],
+          ]
+        },
+      ]
+    }],
   ]
 }
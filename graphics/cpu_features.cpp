@@ -0,0 +1,89 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "cpu_features.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace graphics {
+
+namespace {
+
+CpuFeatures Detect() {
+  CpuFeatures features;
+#if defined(AWRIT_X86)
+  // Also checks that the OS saves the AVX registers
+  __builtin_cpu_init();
+  features.ssse3 = __builtin_cpu_supports("ssse3");
+  features.avx2 = __builtin_cpu_supports("avx2");
+  features.avx512bw = __builtin_cpu_supports("avx512bw");
+#elif defined(AWRIT_NEON)
+  features.neon = true;
+#endif
+  return features;
+}
+
+bool Supported(const CpuFeatures& features, Isa isa) {
+  switch (isa) {
+    case Isa::Scalar:
+      return true;
+    case Isa::SSSE3:
+      return features.ssse3;
+    case Isa::AVX2:
+      return features.avx2;
+    case Isa::AVX512BW:
+      return features.avx512bw;
+    case Isa::NEON:
+      return features.neon;
+  }
+  return false;
+}
+
+Isa Select() {
+  const CpuFeatures& features = GetCpuFeatures();
+  constexpr Isa kPreferred[] = {Isa::AVX512BW, Isa::AVX2, Isa::SSSE3,
+                                Isa::NEON, Isa::Scalar};
+
+  // Lets a slower kernel be forced, for comparing them or ruling one out
+  const char* cap = std::getenv("AWRIT_NATIVE_ISA");
+  bool capped = cap == nullptr || *cap == '\0';
+  for (Isa isa : kPreferred) {
+    if (!capped)
+      capped = std::strcmp(cap, IsaName(isa)) == 0;
+    if (capped && Supported(features, isa))
+      return isa;
+  }
+  return Isa::Scalar;
+}
+
+}  // namespace
+
+const CpuFeatures& GetCpuFeatures() {
+  static const CpuFeatures features = Detect();
+  return features;
+}
+
+Isa ActiveIsa() {
+  static const Isa isa = Select();
+  return isa;
+}
+
+const char* IsaName(Isa isa) {
+  switch (isa) {
+    case Isa::Scalar:
+      return "scalar";
+    case Isa::SSSE3:
+      return "ssse3";
+    case Isa::AVX2:
+      return "avx2";
+    case Isa::AVX512BW:
+      return "avx512bw";
+    case Isa::NEON:
+      return "neon";
+  }
+  return "scalar";
+}
+
+}  // namespace graphics
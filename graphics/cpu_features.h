@@ -0,0 +1,37 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AWRIT_X86 1
+// Compiles a kernel for |isa| regardless of the flags the addon is built with,
+// it must only be called once the CPU is known to support it
+#define AWRIT_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__aarch64__) || defined(_M_ARM64)
+// NEON is part of the baseline for arm64
+#define AWRIT_NEON 1
+#endif
+
+namespace graphics {
+
+// Instruction sets that the pixel kernels are built for
+enum class Isa { Scalar, SSSE3, AVX2, AVX512BW, NEON };
+
+struct CpuFeatures {
+  bool ssse3 = false;
+  bool avx2 = false;
+  bool avx512bw = false;
+  bool neon = false;
+};
+
+// What the CPU and OS support, detected on first use
+const CpuFeatures& GetCpuFeatures();
+
+// The instruction set of the kernels in use, which is the best one supported
+// unless capped by the AWRIT_NATIVE_ISA environment variable
+Isa ActiveIsa();
+
+const char* IsaName(Isa isa);
+
+}  // namespace graphics
@@ -0,0 +1,68 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "deflate.h"
+
+#include "swizzle.h"
+
+namespace graphics {
+
+Deflater::Deflater(std::chrono::microseconds budget) : budget_(budget) {
+  initialized_ = deflateInit(&stream_, level_) == Z_OK;
+}
+
+Deflater::~Deflater() {
+  if (initialized_)
+    deflateEnd(&stream_);
+}
+
+size_t Deflater::Bound(size_t bytes) {
+  return compressBound(bytes);
+}
+
+size_t Deflater::Compress(const char* src, Size size, Rect rect, char* out) {
+  if (!initialized_ || rect.empty())
+    return 0;
+
+  auto start = std::chrono::steady_clock::now();
+  const size_t rowStride = size.width * BYTES_PER_PIXEL;
+  const size_t rowBytes = rect.width * BYTES_PER_PIXEL;
+  const size_t total = rowBytes * rect.height;
+  // Swizzled a row at a time
+  row_.resize(rowBytes);
+
+  // The level only changes between frames, while the stream is empty
+  deflateReset(&stream_);
+  deflateParams(&stream_, level_, Z_DEFAULT_STRATEGY);
+  stream_.next_out = reinterpret_cast<Bytef*>(out);
+  stream_.avail_out = Bound(total);
+
+  const char* origin = src + rect.y * rowStride + rect.x * BYTES_PER_PIXEL;
+  for (uint32_t y = 0; y < rect.height; ++y) {
+    SwizzleRect(origin + y * rowStride, rowStride, row_.data(),
+                {rect.width, 1}, {0, 0, rect.width, 1});
+    stream_.next_in = reinterpret_cast<Bytef*>(row_.data());
+    stream_.avail_in = rowBytes;
+    int flush = y + 1 == rect.height ? Z_FINISH : Z_NO_FLUSH;
+    int result = deflate(&stream_, flush);
+    if (result != (flush == Z_FINISH ? Z_STREAM_END : Z_OK))
+      return 0;
+  }
+
+  Adapt(std::chrono::steady_clock::now() - start);
+  return stream_.total_out;
+}
+
+void Deflater::Adapt(std::chrono::steady_clock::duration elapsed) {
+  // Compression gets half of the budget, the rest goes to encoding and
+  // writing to the terminal
+  auto limit = budget_ / 2;
+  if (elapsed > limit && level_ > kMinLevel) {
+    --level_;
+  } else if (elapsed < limit / 4 && level_ < kMaxLevel) {
+    ++level_;
+  }
+}
+
+}  // namespace graphics
@@ -0,0 +1,53 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <zlib.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "rect.h"
+
+namespace graphics {
+
+// Compresses frames with zlib for kitty's o=z transmissions.
+// The level is adjusted after every frame so that compressing stays within a
+// share of the frame budget: fast pages get smaller payloads, slow ones don't
+// drop frames.
+class Deflater {
+ public:
+  static constexpr int kMinLevel = Z_BEST_SPEED;
+  // Higher levels rarely pay off for screen contents
+  static constexpr int kMaxLevel = 6;
+
+  explicit Deflater(std::chrono::microseconds budget);
+  ~Deflater();
+
+  Deflater(const Deflater&) = delete;
+  Deflater& operator=(const Deflater&) = delete;
+
+  // Most bytes that compressing |bytes| can produce
+  static size_t Bound(size_t bytes);
+
+  // Compresses |rect| of the BGRA frame |src| that is |size| as RGBA into
+  // |out|, which must hold Bound bytes of |rect|. Returns the compressed size,
+  // or 0 on failure.
+  size_t Compress(const char* src, Size size, Rect rect, char* out);
+
+  int level() const { return level_; }
+  std::chrono::microseconds budget() const { return budget_; }
+
+ private:
+  void Adapt(std::chrono::steady_clock::duration elapsed);
+
+  z_stream stream_{};
+  bool initialized_ = false;
+  int level_ = kMinLevel;
+  std::chrono::microseconds budget_;
+  std::vector<char> row_;
+};
+
+}  // namespace graphics
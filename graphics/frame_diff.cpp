@@ -0,0 +1,167 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "frame_diff.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "swizzle.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace graphics {
+
+namespace {
+
+using EqualFn = bool (*)(const char* a, const char* b, size_t size);
+
+bool equal_scalar(const char* a, const char* b, size_t size) {
+  return std::memcmp(a, b, size) == 0;
+}
+
+#if defined(AWRIT_X86)
+// SSE2 is part of the x86-64 baseline, it's used for the SSSE3 tier
+bool equal_sse2(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+      return false;
+  }
+  return std::memcmp(a + i, b + i, size - i) == 0;
+}
+
+AWRIT_TARGET("avx2")
+bool equal_avx2(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != -1)
+      return false;
+  }
+  return std::memcmp(a + i, b + i, size - i) == 0;
+}
+
+AWRIT_TARGET("avx512f,avx512bw")
+bool equal_avx512(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    if (_mm512_cmpneq_epi8_mask(x, y) != 0)
+      return false;
+  }
+  // The tail is compared with a masked load rather than past the row
+  __mmask64 tail = (1ULL << (size - i)) - 1;
+  __m512i x = _mm512_maskz_loadu_epi8(tail, a + i);
+  __m512i y = _mm512_maskz_loadu_epi8(tail, b + i);
+  return _mm512_cmpneq_epi8_mask(x, y) == 0;
+}
+#elif defined(AWRIT_NEON)
+bool equal_neon(const char* a, const char* b, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t x = vld1q_u8((const uint8_t*)(a + i));
+    uint8x16_t y = vld1q_u8((const uint8_t*)(b + i));
+    if (vminvq_u8(vceqq_u8(x, y)) != 0xff)
+      return false;
+  }
+  return std::memcmp(a + i, b + i, size - i) == 0;
+}
+#endif
+
+EqualFn select_equal() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return equal_avx512;
+    case Isa::AVX2:
+      return equal_avx2;
+    case Isa::SSSE3:
+      return equal_sse2;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return equal_neon;
+#endif
+    default:
+      return equal_scalar;
+  }
+}
+
+}  // namespace
+
+std::vector<Rect> FrameDiff::Diff(const char* src, Size size, Rect rect) {
+  rect = ClampRect(rect, size);
+  size_t rowStride = size.width * BYTES_PER_PIXEL;
+
+  if (size.width != size_.width || size.height != size_.height ||
+      previous_.empty()) {
+    previous_.assign(src, src + rowStride * size.height);
+    size_ = size;
+    if (rect.empty())
+      return {};
+    return {rect};
+  }
+
+  static const EqualFn equal = select_equal();
+  std::vector<Rect> dirty;
+  const uint32_t right = rect.x + rect.width;
+  const uint32_t bottom = rect.y + rect.height;
+  char* previous = previous_.data();
+
+  for (uint32_t ty = rect.y - rect.y % tile_size_; ty < bottom;
+       ty += tile_size_) {
+    uint32_t y0 = std::max(ty, rect.y);
+    uint32_t y1 = std::min(ty + tile_size_, bottom);
+
+    // Consecutive dirty tiles in this row of tiles
+    Rect run;
+    for (uint32_t tx = rect.x - rect.x % tile_size_; tx < right;
+         tx += tile_size_) {
+      uint32_t x0 = std::max(tx, rect.x);
+      uint32_t x1 = std::min(tx + tile_size_, right);
+      size_t bytes = (x1 - x0) * BYTES_PER_PIXEL;
+
+      uint32_t y = y0;
+      for (; y < y1; ++y) {
+        size_t offset = y * rowStride + x0 * BYTES_PER_PIXEL;
+        if (!equal(src + offset, previous + offset, bytes))
+          break;
+      }
+
+      if (y == y1) {
+        if (!run.empty())
+          dirty.push_back(run);
+        run = {};
+        continue;
+      }
+
+      // Rows before the first difference already match
+      for (; y < y1; ++y) {
+        size_t offset = y * rowStride + x0 * BYTES_PER_PIXEL;
+        std::memcpy(previous + offset, src + offset, bytes);
+      }
+      run = UnionRect(run, {x0, y0, x1 - x0, y1 - y0});
+    }
+    if (!run.empty())
+      dirty.push_back(run);
+  }
+
+  return CoalesceRects(std::move(dirty));
+}
+
+void FrameDiff::Reset() {
+  previous_.clear();
+  previous_.shrink_to_fit();
+  size_ = {};
+}
+
+}  // namespace graphics
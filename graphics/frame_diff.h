@@ -0,0 +1,38 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstdint>
+#include <vector>
+
+#include "rect.h"
+
+namespace graphics {
+
+// Finds the tiles of a frame that changed since the previous frame
+class FrameDiff {
+ public:
+  static constexpr uint32_t kDefaultTileSize = 64;
+
+  explicit FrameDiff(uint32_t tile_size = kDefaultTileSize)
+      : tile_size_(tile_size) {}
+
+  // Compares |rect| of the BGRA frame |src| that is |size| against the
+  // previous frame and returns the changed tiles, merged into rects and
+  // clipped to |rect|. The first frame and frames of a new size are dirty
+  // throughout |rect|.
+  std::vector<Rect> Diff(const char* src, Size size, Rect rect);
+
+  // Forgets the previous frame
+  void Reset();
+
+  uint32_t tile_size() const { return tile_size_; }
+
+ private:
+  uint32_t tile_size_;
+  Size size_;
+  std::vector<char> previous_;
+};
+
+}  // namespace graphics
@@ -0,0 +1,132 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "frame_stats.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+
+namespace graphics {
+
+namespace {
+
+size_t bucket_of(uint64_t nanos) {
+  if (nanos < 4)
+    return nanos;
+  int log = 63 - __builtin_clzll(nanos);
+  // The two bits after the leading one pick the quarter
+  return log * 4 + ((nanos >> (log - 2)) & 3);
+}
+
+uint64_t bucket_limit(size_t bucket) {
+  if (bucket < 4)
+    return bucket;
+  size_t log = bucket / 4;
+  uint64_t base = 1ULL << log;
+  uint64_t limit = base + ((bucket % 4) + 1) * (base >> 2) - 1;
+  // The last bucket would overflow
+  return limit < base ? UINT64_MAX : limit;
+}
+
+#ifdef RUSAGE_THREAD
+constexpr bool kPerThreadFaults = true;
+#else
+constexpr bool kPerThreadFaults = false;
+#endif
+
+// The innermost ScopedFaults of each thread
+thread_local ScopedFaults* current_faults = nullptr;
+
+}  // namespace
+
+bool ReadThreadFaults(Faults& faults) {
+  struct rusage usage;
+#ifdef RUSAGE_THREAD
+  if (getrusage(RUSAGE_THREAD, &usage) != 0)
+#else
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+#endif
+    return false;
+  faults.minor = usage.ru_minflt;
+  faults.major = usage.ru_majflt;
+  return true;
+}
+
+const char* PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::Open:
+      return "open";
+    case Phase::Resize:
+      return "resize";
+    case Phase::Map:
+      return "map";
+    case Phase::Swizzle:
+      return "swizzle";
+    case Phase::Unmap:
+      return "unmap";
+    case Phase::Frame:
+      return "frame";
+    case Phase::kCount:
+      break;
+  }
+  return "";
+}
+
+void Histogram::Add(uint64_t nanos) {
+  ++buckets_[bucket_of(nanos)];
+  ++count_;
+  min_ = std::min(min_, nanos);
+  max_ = std::max(max_, nanos);
+  sum_ += nanos;
+}
+
+uint64_t Histogram::Percentile(double fraction) const {
+  if (count_ == 0)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, fraction * count_ + 0.5);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank)
+      return std::min(bucket_limit(i), max_);
+  }
+  return max_;
+}
+
+ScopedFaults::ScopedFaults(FrameStats* stats)
+    : stats_(stats), outer_(current_faults) {
+  if (stats_ != nullptr && !ReadThreadFaults(start_))
+    stats_ = nullptr;
+  current_faults = this;
+}
+
+ScopedFaults::~ScopedFaults() {
+  current_faults = outer_;
+  // Delegated faults don't show up in the outer one's own thread counts
+  if (outer_ != nullptr) {
+    outer_->delegated_.minor += delegated_.minor;
+    outer_->delegated_.major += delegated_.major;
+  }
+  Faults end;
+  if (stats_ != nullptr && ReadThreadFaults(end)) {
+    stats_->minor_faults += end.minor - start_.minor + delegated_.minor;
+    stats_->major_faults += end.major - start_.major + delegated_.major;
+  }
+}
+
+bool ScopedFaults::Active() {
+  // Process wide counts already include every other thread
+  return kPerThreadFaults && current_faults != nullptr &&
+         current_faults->stats_ != nullptr;
+}
+
+void ScopedFaults::AddDelegated(const Faults& faults) {
+  if (current_faults == nullptr)
+    return;
+  current_faults->delegated_.minor += faults.minor;
+  current_faults->delegated_.major += faults.major;
+}
+
+}  // namespace graphics
@@ -0,0 +1,122 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace graphics {
+
+// Steps of writing a frame to shared memory
+enum class Phase { Open, Resize, Map, Swizzle, Unmap, Frame, kCount };
+
+const char* PhaseName(Phase phase);
+
+// Durations bucketed by quarter powers of two, so percentiles are within
+// about 19% of the real value without storing every sample
+class Histogram {
+ public:
+  void Add(uint64_t nanos);
+  void Reset() { *this = Histogram(); }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  uint64_t average() const { return count_ ? sum_ / count_ : 0; }
+  // Upper bound of the bucket that holds the |fraction| quantile
+  uint64_t Percentile(double fraction) const;
+
+ private:
+  static constexpr size_t kBuckets = 64 * 4;
+
+  std::array<uint64_t, kBuckets> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+  uint64_t sum_ = 0;
+};
+
+// Counters for the frames written to a segment, not thread safe
+struct FrameStats {
+  std::array<Histogram, static_cast<size_t>(Phase::kCount)> phases;
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  // Segments that had to be opened or mapped again
+  uint64_t remaps = 0;
+  uint64_t minor_faults = 0;
+  uint64_t major_faults = 0;
+
+  Histogram& operator[](Phase phase) {
+    return phases[static_cast<size_t>(phase)];
+  }
+  const Histogram& operator[](Phase phase) const {
+    return phases[static_cast<size_t>(phase)];
+  }
+  void Reset() { *this = FrameStats(); }
+};
+
+// Adds the time until it goes out of scope to |phase| of |stats|, doing
+// nothing when |stats| is null
+class ScopedPhase {
+ public:
+  ScopedPhase(FrameStats* stats, Phase phase) : stats_(stats), phase_(phase) {
+    if (stats_ != nullptr)
+      start_ = std::chrono::steady_clock::now();
+  }
+  ~ScopedPhase() {
+    if (stats_ != nullptr) {
+      auto elapsed = std::chrono::steady_clock::now() - start_;
+      (*stats_)[phase_].Add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count());
+    }
+  }
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+ private:
+  FrameStats* stats_;
+  Phase phase_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+struct Faults {
+  int64_t minor = 0;
+  int64_t major = 0;
+};
+
+// Reads the page faults taken by the calling thread, or by the whole process
+// where the platform can't tell threads apart
+bool ReadThreadFaults(Faults& faults);
+
+// Adds the page faults taken by the calling thread until it goes out of scope
+// to |stats|, along with those of WorkerPool tasks run on its behalf, doing
+// nothing when |stats| is null
+class ScopedFaults {
+ public:
+  explicit ScopedFaults(FrameStats* stats);
+  ~ScopedFaults();
+
+  ScopedFaults(const ScopedFaults&) = delete;
+  ScopedFaults& operator=(const ScopedFaults&) = delete;
+
+  // Whether faults taken on other threads for the calling thread should be
+  // measured, which is only when it has a ScopedFaults open and the
+  // platform counts faults per thread
+  static bool Active();
+  // Adds faults taken on other threads to the calling thread's innermost
+  // ScopedFaults
+  static void AddDelegated(const Faults& faults);
+
+ private:
+  FrameStats* stats_;
+  ScopedFaults* outer_;
+  Faults start_;
+  Faults delegated_;
+};
+
+}  // namespace graphics
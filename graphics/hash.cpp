@@ -0,0 +1,171 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "hash.h"
+
+#include <cstring>
+
+#include "cpu_features.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace graphics {
+
+namespace {
+
+constexpr size_t kStripe = 32;
+
+constexpr uint64_t kPrime32 = 0x9E3779B1ULL;
+constexpr uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+// The start of the XXH3 default secret
+alignas(32) constexpr uint64_t kSecret[4] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+    0x1f67b3b7a4a44072ULL};
+
+// Adds |stripes| 32 byte stripes of |data| into |acc|
+using AccumulateFn = void (*)(uint64_t* acc, const char* data, size_t stripes);
+
+void accumulate_scalar(uint64_t* acc, const char* data, size_t stripes) {
+  for (size_t s = 0; s < stripes; ++s, data += kStripe) {
+    for (size_t i = 0; i < 4; ++i) {
+      uint64_t value;
+      std::memcpy(&value, data + i * 8, sizeof(value));
+      uint64_t keyed = value ^ kSecret[i];
+      acc[i] += (keyed & 0xffffffff) * (keyed >> 32) + value;
+    }
+  }
+}
+
+#if defined(AWRIT_X86)
+// SSE2 is part of the x86-64 baseline, it's used for the SSSE3 tier
+void accumulate_sse2(uint64_t* acc, const char* data, size_t stripes) {
+  __m128i acc0 = _mm_load_si128((const __m128i*)acc);
+  __m128i acc1 = _mm_load_si128((const __m128i*)(acc + 2));
+  const __m128i key0 = _mm_load_si128((const __m128i*)kSecret);
+  const __m128i key1 = _mm_load_si128((const __m128i*)(kSecret + 2));
+  for (size_t s = 0; s < stripes; ++s, data += kStripe) {
+    __m128i value0 = _mm_loadu_si128((const __m128i*)data);
+    __m128i value1 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i keyed0 = _mm_xor_si128(value0, key0);
+    __m128i keyed1 = _mm_xor_si128(value1, key1);
+    __m128i product0 = _mm_mul_epu32(keyed0, _mm_srli_epi64(keyed0, 32));
+    __m128i product1 = _mm_mul_epu32(keyed1, _mm_srli_epi64(keyed1, 32));
+    acc0 = _mm_add_epi64(acc0, _mm_add_epi64(product0, value0));
+    acc1 = _mm_add_epi64(acc1, _mm_add_epi64(product1, value1));
+  }
+  _mm_store_si128((__m128i*)acc, acc0);
+  _mm_store_si128((__m128i*)(acc + 2), acc1);
+}
+
+AWRIT_TARGET("avx2")
+void accumulate_avx2(uint64_t* acc, const char* data, size_t stripes) {
+  __m256i sum = _mm256_load_si256((const __m256i*)acc);
+  const __m256i key = _mm256_load_si256((const __m256i*)kSecret);
+  for (size_t s = 0; s < stripes; ++s, data += kStripe) {
+    __m256i value = _mm256_loadu_si256((const __m256i*)data);
+    __m256i keyed = _mm256_xor_si256(value, key);
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+    sum = _mm256_add_epi64(sum, _mm256_add_epi64(product, value));
+  }
+  _mm256_store_si256((__m256i*)acc, sum);
+}
+#elif defined(AWRIT_NEON)
+void accumulate_neon(uint64_t* acc, const char* data, size_t stripes) {
+  uint64x2_t acc0 = vld1q_u64(acc);
+  uint64x2_t acc1 = vld1q_u64(acc + 2);
+  const uint64x2_t key0 = vld1q_u64(kSecret);
+  const uint64x2_t key1 = vld1q_u64(kSecret + 2);
+  for (size_t s = 0; s < stripes; ++s, data += kStripe) {
+    uint64x2_t value0 = vreinterpretq_u64_u8(vld1q_u8((const uint8_t*)data));
+    uint64x2_t value1 =
+        vreinterpretq_u64_u8(vld1q_u8((const uint8_t*)(data + 16)));
+    uint64x2_t keyed0 = veorq_u64(value0, key0);
+    uint64x2_t keyed1 = veorq_u64(value1, key1);
+    uint64x2_t product0 =
+        vmull_u32(vmovn_u64(keyed0), vshrn_n_u64(keyed0, 32));
+    uint64x2_t product1 =
+        vmull_u32(vmovn_u64(keyed1), vshrn_n_u64(keyed1, 32));
+    acc0 = vaddq_u64(acc0, vaddq_u64(product0, value0));
+    acc1 = vaddq_u64(acc1, vaddq_u64(product1, value1));
+  }
+  vst1q_u64(acc, acc0);
+  vst1q_u64(acc + 2, acc1);
+}
+#endif
+
+AccumulateFn select_accumulate() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+    case Isa::AVX2:
+      return accumulate_avx2;
+    case Isa::SSSE3:
+      return accumulate_sse2;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return accumulate_neon;
+#endif
+    default:
+      return accumulate_scalar;
+  }
+}
+
+uint64_t mul_fold(uint64_t a, uint64_t b) {
+  __uint128_t product = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(product) ^
+         static_cast<uint64_t>(product >> 64);
+}
+
+}  // namespace
+
+Hasher::Hasher() {
+  acc_[0] = kPrime32;
+  acc_[1] = kPrime64_1;
+  acc_[2] = kPrime64_2;
+  acc_[3] = kPrime64_1 ^ kPrime64_2;
+}
+
+void Hasher::Update(const char* data, size_t size) {
+  static const AccumulateFn accumulate = select_accumulate();
+
+  size_t stripes = size / kStripe;
+  accumulate(acc_, data, stripes);
+  if (size % kStripe != 0) {
+    char tail[kStripe] = {};
+    std::memcpy(tail, data + stripes * kStripe, size % kStripe);
+    accumulate(acc_, tail, 1);
+  }
+
+  // Scrambled after every run so that long inputs don't just add up
+  for (uint64_t& acc : acc_) {
+    acc ^= acc >> 47;
+    acc *= kPrime32;
+  }
+  length_ += size;
+}
+
+uint64_t Hasher::Digest() const {
+  uint64_t result = length_ * kPrime64_1;
+  result += mul_fold(acc_[0] ^ kSecret[2], acc_[1] ^ kSecret[3]);
+  result += mul_fold(acc_[2] ^ kSecret[0], acc_[3] ^ kSecret[1]);
+  // XXH3 avalanche
+  result ^= result >> 37;
+  result *= 0x165667919E3779F9ULL;
+  result ^= result >> 32;
+  return result;
+}
+
+uint64_t HashBytes(const char* data, size_t size) {
+  Hasher hasher;
+  hasher.Update(data, size);
+  return hasher.Digest();
+}
+
+}  // namespace graphics
@@ -0,0 +1,32 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace graphics {
+
+// Streaming 64-bit hash of pixel rows, built like XXH3: 32 byte stripes are
+// multiplied into four accumulators, which are mixed down at the end.
+// Every kernel produces the same hash. It is meant for spotting identical
+// content, not for use against adversarial input.
+class Hasher {
+ public:
+  Hasher();
+
+  // Adds |size| bytes, a partial stripe at the end is padded with zeros
+  void Update(const char* data, size_t size);
+
+  uint64_t Digest() const;
+
+ private:
+  alignas(32) uint64_t acc_[4];
+  uint64_t length_ = 0;
+};
+
+// Hash of |size| bytes, same as a Hasher given them in one Update
+uint64_t HashBytes(const char* data, size_t size);
+
+}  // namespace graphics
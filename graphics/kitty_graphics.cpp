@@ -0,0 +1,433 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "kitty_graphics.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+#include "swizzle.h"
+#include "tty/escape_codes.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace graphics::kitty {
+
+namespace {
+
+constexpr char kAlphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Index of the BGRA byte that ends up at |index| once swizzled to RGBA
+constexpr size_t swizzled(size_t index) {
+  switch (index & 3) {
+    case 0:
+      return (index & ~3) | 2;
+    case 2:
+      return index & ~3;
+    default:
+      return index;
+  }
+}
+
+// With |kSwizzle|, the bytes are read as BGRA pixels and encoded as RGBA
+template <bool kSwizzle>
+constexpr size_t source_index(size_t index) {
+  return kSwizzle ? swizzled(index) : index;
+}
+
+template <bool kSwizzle>
+size_t base64_scalar(const uint8_t* src, size_t size, char* out) {
+  char* start = out;
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    uint32_t triple = src[source_index<kSwizzle>(i)] << 16 |
+                      src[source_index<kSwizzle>(i + 1)] << 8 |
+                      src[source_index<kSwizzle>(i + 2)];
+    *out++ = kAlphabet[triple >> 18 & 63];
+    *out++ = kAlphabet[triple >> 12 & 63];
+    *out++ = kAlphabet[triple >> 6 & 63];
+    *out++ = kAlphabet[triple & 63];
+  }
+
+  if (i < size) {
+    uint32_t triple = src[source_index<kSwizzle>(i)] << 16;
+    if (i + 1 < size)
+      triple |= src[source_index<kSwizzle>(i + 1)] << 8;
+    *out++ = kAlphabet[triple >> 18 & 63];
+    *out++ = kAlphabet[triple >> 12 & 63];
+    *out++ = i + 1 < size ? kAlphabet[triple >> 6 & 63] : '=';
+    *out++ = '=';
+  }
+
+  return out - start;
+}
+
+using Base64Fn = size_t (*)(const char* src, size_t size, char* out);
+
+template <bool kSwizzle>
+size_t base64_generic(const char* src, size_t size, char* out) {
+  return base64_scalar<kSwizzle>((const uint8_t*)src, size, out);
+}
+
+#if defined(AWRIT_X86)
+// Spreads each 3 byte group of a 12 byte lane over 4 bytes as described in
+// http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html, the lane
+// starting |offset| bytes into its register
+template <bool kSwizzle>
+constexpr std::array<uint8_t, 16> make_reshuffle(size_t offset) {
+  std::array<uint8_t, 16> table{};
+  for (size_t group = 0; group < 4; ++group) {
+    size_t base = offset + group * 3;
+    table[group * 4] = source_index<kSwizzle>(base + 1);
+    table[group * 4 + 1] = source_index<kSwizzle>(base);
+    table[group * 4 + 2] = source_index<kSwizzle>(base + 2);
+    table[group * 4 + 3] = source_index<kSwizzle>(base + 1);
+  }
+  return table;
+}
+
+// Repeats |table| for every 128-bit lane of a 512-bit register
+template <typename T>
+constexpr std::array<T, 64> repeat_lanes(const std::array<T, 16>& table) {
+  std::array<T, 64> result{};
+  for (size_t i = 0; i < result.size(); ++i) {
+    result[i] = table[i % 16];
+  }
+  return result;
+}
+
+template <bool kSwizzle>
+alignas(64) constexpr std::array<uint8_t, 64> kReshuffle =
+    repeat_lanes(make_reshuffle<kSwizzle>(0));
+
+// The low lane is offset by 4 so that the 24 bytes can be read with one
+// unaligned load
+template <bool kSwizzle>
+alignas(32) constexpr std::array<std::array<uint8_t, 16>, 2> kReshuffle256 = {
+    make_reshuffle<kSwizzle>(4), make_reshuffle<kSwizzle>(0)};
+
+// Offsets from the 6 bit values to their characters, by range
+alignas(64) constexpr std::array<int8_t, 64> kOffsets = repeat_lanes<int8_t>(
+    {65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0});
+
+template <bool kSwizzle>
+AWRIT_TARGET("ssse3")
+size_t base64_ssse3(const char* src, size_t size, char* out) {
+  char* start = out;
+  size_t i = 0;
+  const __m128i shuffle =
+      _mm_load_si128((const __m128i*)kReshuffle<kSwizzle>.data());
+  const __m128i lut = _mm_load_si128((const __m128i*)kOffsets.data());
+  for (; size - i >= 16; i += 12, out += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+    in = _mm_shuffle_epi8(in, shuffle);
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);
+
+    __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+    indices = _mm_sub_epi8(indices, mask);
+    in = _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+    _mm_storeu_si128((__m128i*)out, in);
+  }
+
+  out += base64_scalar<kSwizzle>((const uint8_t*)(src + i), size - i, out);
+  return out - start;
+}
+
+template <bool kSwizzle>
+AWRIT_TARGET("avx2")
+size_t base64_avx2(const char* src, size_t size, char* out) {
+  char* start = out;
+  size_t i = 0;
+  const __m256i shuffle =
+      _mm256_load_si256((const __m256i*)kReshuffle256<kSwizzle>.data());
+  const __m256i lut = _mm256_load_si256((const __m256i*)kOffsets.data());
+
+  if (size >= 32) {
+    // The first 4 bytes are before |src|, so they are masked off
+    __m256i input = _mm256_maskload_epi32(
+        (const int*)(src - 4),
+        _mm256_set_epi32(INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN,
+                         INT32_MIN, INT32_MIN, 0));
+    while (true) {
+      __m256i in = _mm256_shuffle_epi8(input, shuffle);
+      const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+      const __m256i t1 =
+          _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+      const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+      const __m256i t3 =
+          _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+      in = _mm256_or_si256(t1, t3);
+
+      __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+      __m256i mask = _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25));
+      indices = _mm256_sub_epi8(indices, mask);
+      in = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+      _mm256_storeu_si256((__m256i*)out, in);
+
+      i += 24;
+      out += 32;
+      if (size - i < 32)
+        break;
+      input = _mm256_loadu_si256((const __m256i*)(src + i - 4));
+    }
+  }
+
+  out += base64_scalar<kSwizzle>((const uint8_t*)(src + i), size - i, out);
+  return out - start;
+}
+
+template <bool kSwizzle>
+AWRIT_TARGET("avx512f,avx512bw,avx2")
+size_t base64_avx512(const char* src, size_t size, char* out) {
+  char* start = out;
+  size_t i = 0;
+  // Each 128-bit lane gets the 12 bytes that start at its first dword
+  const __m512i lanes =
+      _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+  const __m512i shuffle = _mm512_load_si512(kReshuffle<kSwizzle>.data());
+  const __m512i lut = _mm512_load_si512(kOffsets.data());
+  for (; size - i >= 64; i += 48, out += 64) {
+    // The zero-masked form sidesteps a false uninitialized warning in GCC 12
+    __m512i in = _mm512_maskz_permutexvar_epi32(0xffff, lanes,
+                                                _mm512_loadu_si512(src + i));
+    in = _mm512_shuffle_epi8(in, shuffle);
+    const __m512i t0 = _mm512_and_si512(in, _mm512_set1_epi32(0x0fc0fc00));
+    const __m512i t1 = _mm512_mulhi_epu16(t0, _mm512_set1_epi32(0x04000040));
+    const __m512i t2 = _mm512_and_si512(in, _mm512_set1_epi32(0x003f03f0));
+    const __m512i t3 = _mm512_mullo_epi16(t2, _mm512_set1_epi32(0x01000010));
+    in = _mm512_or_si512(t1, t3);
+
+    __m512i indices = _mm512_subs_epu8(in, _mm512_set1_epi8(51));
+    __mmask64 mask = _mm512_cmpgt_epi8_mask(in, _mm512_set1_epi8(25));
+    indices = _mm512_mask_add_epi8(indices, mask, indices, _mm512_set1_epi8(1));
+    in = _mm512_add_epi8(in, _mm512_shuffle_epi8(lut, indices));
+    _mm512_storeu_si512(out, in);
+  }
+
+  out += base64_avx2<kSwizzle>(src + i, size - i, out);
+  return out - start;
+}
+
+#elif defined(AWRIT_NEON)
+// Picks byte |part| of every 3 byte group out of 48 bytes
+template <bool kSwizzle>
+constexpr std::array<std::array<uint8_t, 16>, 3> make_gather() {
+  std::array<std::array<uint8_t, 16>, 3> table{};
+  for (size_t part = 0; part < 3; ++part) {
+    for (size_t i = 0; i < 16; ++i) {
+      table[part][i] = source_index<kSwizzle>(i * 3 + part);
+    }
+  }
+  return table;
+}
+
+template <bool kSwizzle>
+constexpr std::array<std::array<uint8_t, 16>, 3> kGather =
+    make_gather<kSwizzle>();
+
+template <bool kSwizzle>
+size_t base64_neon(const char* src, size_t size, char* out) {
+  char* start = out;
+  size_t i = 0;
+  const uint8_t* alphabet = (const uint8_t*)kAlphabet;
+  const uint8x16x4_t lut = {{vld1q_u8(alphabet), vld1q_u8(alphabet + 16),
+                             vld1q_u8(alphabet + 32),
+                             vld1q_u8(alphabet + 48)}};
+  const uint8x16_t gather0 = vld1q_u8(kGather<kSwizzle>[0].data());
+  const uint8x16_t gather1 = vld1q_u8(kGather<kSwizzle>[1].data());
+  const uint8x16_t gather2 = vld1q_u8(kGather<kSwizzle>[2].data());
+  const uint8x16_t mask = vdupq_n_u8(63);
+  for (; i + 48 <= size; i += 48, out += 64) {
+    const uint8_t* in = (const uint8_t*)(src + i);
+    uint8x16x3_t pixels = {
+        {vld1q_u8(in), vld1q_u8(in + 16), vld1q_u8(in + 32)}};
+    uint8x16_t x0 = vqtbl3q_u8(pixels, gather0);
+    uint8x16_t x1 = vqtbl3q_u8(pixels, gather1);
+    uint8x16_t x2 = vqtbl3q_u8(pixels, gather2);
+
+    uint8x16x4_t result;
+    result.val[0] = vshrq_n_u8(x0, 2);
+    result.val[1] =
+        vandq_u8(vorrq_u8(vshlq_n_u8(x0, 4), vshrq_n_u8(x1, 4)), mask);
+    result.val[2] =
+        vandq_u8(vorrq_u8(vshlq_n_u8(x1, 2), vshrq_n_u8(x2, 6)), mask);
+    result.val[3] = vandq_u8(x2, mask);
+    result.val[0] = vqtbl4q_u8(lut, result.val[0]);
+    result.val[1] = vqtbl4q_u8(lut, result.val[1]);
+    result.val[2] = vqtbl4q_u8(lut, result.val[2]);
+    result.val[3] = vqtbl4q_u8(lut, result.val[3]);
+    vst4q_u8((uint8_t*)out, result);
+  }
+
+  out += base64_scalar<kSwizzle>((const uint8_t*)(src + i), size - i, out);
+  return out - start;
+}
+#endif
+
+template <bool kSwizzle>
+Base64Fn select_base64() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return base64_avx512<kSwizzle>;
+    case Isa::AVX2:
+      return base64_avx2<kSwizzle>;
+    case Isa::SSSE3:
+      return base64_ssse3<kSwizzle>;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return base64_neon<kSwizzle>;
+#endif
+    default:
+      return base64_generic<kSwizzle>;
+  }
+}
+
+template <bool kSwizzle>
+size_t base64(const char* src, size_t size, char* out) {
+  static const Base64Fn encode = select_base64<kSwizzle>();
+  return encode(src, size, out);
+}
+
+char* append(char* out, std::string_view str) {
+  std::memcpy(out, str.data(), str.size());
+  return out + str.size();
+}
+
+char* append(char* out, uint32_t value) {
+  return std::to_chars(out, out + 10, value).ptr;
+}
+
+// Writes |total| bytes of payload for |rect| as escapes of at most one chunk.
+// |format| holds the keys that describe the payload, |fill| returns the
+// payload bytes starting at an offset.
+template <bool kSwizzle, typename Fill>
+size_t write_chunks(size_t total,
+                    Rect rect,
+                    std::string_view format,
+                    std::string_view control,
+                    char* out,
+                    Fill fill) {
+  char* start = out;
+  for (size_t offset = 0; offset < total; offset += kChunkPixelBytes) {
+    size_t bytes = std::min(kChunkPixelBytes, total - offset);
+    const char* chunk = fill(offset, bytes);
+
+    bool first = offset == 0;
+    bool last = offset + bytes == total;
+    out = append(out, KITTY_GRAPHICS);
+    if (first) {
+      if (!control.empty()) {
+        out = append(out, control);
+        *out++ = ',';
+      }
+      out = append(out, format);
+      out = append(out, ",s=");
+      out = append(out, rect.width);
+      out = append(out, ",v=");
+      out = append(out, rect.height);
+      if (!last)
+        out = append(out, ",m=1");
+    } else {
+      out = append(out, last ? "m=0" : "m=1");
+    }
+    *out++ = ';';
+    out += base64<kSwizzle>(chunk, bytes, out);
+    out = append(out, ST);
+  }
+
+  return out - start;
+}
+
+}  // namespace
+
+size_t Base64(const char* src, size_t size, char* out) {
+  return base64<false>(src, size, out);
+}
+
+size_t Base64Swizzle(const char* src, size_t size, char* out) {
+  return base64<true>(src, size, out);
+}
+
+size_t MaxEncodedSize(size_t bytes, std::string_view control) {
+  size_t payload = (bytes + 2) / 3 * 4;
+  size_t chunks = std::max<size_t>(1, (payload + kChunkSize - 1) / kChunkSize);
+  // KITTY_GRAPHICS "m=1;" ... ST
+  constexpr size_t kChunkOverhead = 9;
+  // ",f=32,o=z,s=4294967295,v=4294967295,m=1"
+  constexpr size_t kHeaderOverhead = 40;
+  return payload + chunks * kChunkOverhead + control.size() + kHeaderOverhead;
+}
+
+size_t MaxEncodedSize(Rect rect, std::string_view control) {
+  return MaxEncodedSize(rect.area() * BYTES_PER_PIXEL, control);
+}
+
+size_t Encode(const char* src,
+              Size size,
+              Rect rect,
+              std::string_view control,
+              char* out) {
+  if (rect.empty())
+    return 0;
+
+  const size_t rowStride = size.width * BYTES_PER_PIXEL;
+  const size_t rowBytes = rect.width * BYTES_PER_PIXEL;
+  const size_t total = rowBytes * rect.height;
+  const char* origin = src + rect.y * rowStride + rect.x * BYTES_PER_PIXEL;
+  // Full rows are already laid out the way they're sent
+  if (rect.width == size.width) {
+    return write_chunks<true>(
+        total, rect, "f=32", control, out,
+        [origin](size_t offset, size_t) { return origin + offset; });
+  }
+
+  // Each chunk is gathered from the rows of |rect| while it's hot in cache
+  char staging[kChunkPixelBytes];
+  size_t row = 0;
+  size_t column = 0;
+  return write_chunks<true>(
+      total, rect, "f=32", control, out, [&](size_t, size_t bytes) {
+        for (size_t gathered = 0; gathered < bytes;) {
+          size_t count = std::min(rowBytes - column, bytes - gathered);
+          std::memcpy(staging + gathered, origin + row * rowStride + column,
+                      count);
+          gathered += count;
+          column += count;
+          if (column == rowBytes) {
+            column = 0;
+            ++row;
+          }
+        }
+        return static_cast<const char*>(staging);
+      });
+}
+
+size_t EncodeCompressed(const char* data,
+                        size_t bytes,
+                        Rect rect,
+                        std::string_view control,
+                        char* out) {
+  if (rect.empty() || bytes == 0)
+    return 0;
+
+  return write_chunks<false>(
+      bytes, rect, "f=32,o=z", control, out,
+      [data](size_t offset, size_t) { return data + offset; });
+}
+
+}  // namespace graphics::kitty
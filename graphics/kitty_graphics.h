@@ -0,0 +1,53 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+#include <string_view>
+
+#include "rect.h"
+
+// see https://sw.kovidgoyal.net/kitty/graphics-protocol/
+namespace graphics::kitty {
+
+// Largest base64 payload the terminal accepts in a single escape
+constexpr size_t kChunkSize = 4096;
+// Pixel bytes that encode to exactly one chunk
+constexpr size_t kChunkPixelBytes = kChunkSize / 4 * 3;
+
+// Most bytes that Encode can write for |rect| and |control|
+size_t MaxEncodedSize(Rect rect, std::string_view control);
+
+// Most bytes that EncodeCompressed can write for |bytes| of payload
+size_t MaxEncodedSize(size_t bytes, std::string_view control);
+
+// Encodes |rect| of the BGRA frame |src| that is |size| as RGBA for direct
+// transmission (t=d), split into as many escapes as the protocol requires.
+// |control| holds the keys for the first escape other than the format and
+// size, such as "a=T,i=1,q=2".
+// |out| must hold MaxEncodedSize bytes, the number of bytes written is
+// returned.
+size_t Encode(const char* src,
+              Size size,
+              Rect rect,
+              std::string_view control,
+              char* out);
+
+// Same as Encode, but for |bytes| of zlib compressed RGBA pixels (o=z) that
+// make up |rect|
+size_t EncodeCompressed(const char* data,
+                        size_t bytes,
+                        Rect rect,
+                        std::string_view control,
+                        char* out);
+
+// Writes the base64 encoding of |size| bytes to |out|, returning the number of
+// characters written
+size_t Base64(const char* src, size_t size, char* out);
+
+// Writes the base64 encoding of |size| bytes of BGRA pixels as RGBA to |out|,
+// returning the number of characters written
+size_t Base64Swizzle(const char* src, size_t size, char* out);
+
+}  // namespace graphics::kitty
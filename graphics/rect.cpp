@@ -0,0 +1,73 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "rect.h"
+
+#include <algorithm>
+
+namespace graphics {
+
+Rect ClampRect(Rect rect, Size size) {
+  if (rect.x >= size.width)
+    rect.x = 0;
+  if (rect.y >= size.height)
+    rect.y = 0;
+  if (rect.width > size.width - rect.x)
+    rect.width = size.width - rect.x;
+  if (rect.height > size.height - rect.y)
+    rect.height = size.height - rect.y;
+  return rect;
+}
+
+Rect UnionRect(const Rect& a, const Rect& b) {
+  if (a.empty())
+    return b;
+  if (b.empty())
+    return a;
+
+  uint32_t x = std::min(a.x, b.x);
+  uint32_t y = std::min(a.y, b.y);
+  uint32_t right = std::max(a.x + a.width, b.x + b.width);
+  uint32_t bottom = std::max(a.y + a.height, b.y + b.height);
+  return {x, y, right - x, bottom - y};
+}
+
+namespace {
+
+bool touches(const Rect& a, const Rect& b) {
+  return a.x <= b.x + b.width && b.x <= a.x + a.width &&
+         a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+}  // namespace
+
+std::vector<Rect> CoalesceRects(std::vector<Rect> rects) {
+  rects.erase(std::remove_if(rects.begin(), rects.end(),
+                             [](const Rect& rect) { return rect.empty(); }),
+              rects.end());
+
+  // Merging can make a rect reach others it didn't before, so keep going until
+  // nothing changes
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < rects.size(); ++i) {
+      for (size_t j = i + 1; j < rects.size();) {
+        Rect merge = UnionRect(rects[i], rects[j]);
+        if (touches(rects[i], rects[j]) &&
+            merge.area() <= rects[i].area() + rects[j].area()) {
+          rects[i] = merge;
+          rects.erase(rects.begin() + j);
+          merged = true;
+        } else {
+          ++j;
+        }
+      }
+    }
+  }
+
+  return rects;
+}
+
+}  // namespace graphics
@@ -0,0 +1,36 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstdint>
+#include <vector>
+
+namespace graphics {
+
+struct Size {
+  uint32_t width = 0;
+  uint32_t height = 0;
+};
+
+struct Rect {
+  uint32_t x = 0;
+  uint32_t y = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  bool empty() const { return width == 0 || height == 0; }
+  uint64_t area() const { return static_cast<uint64_t>(width) * height; }
+};
+
+// Clamps |rect| to lie within |size|, resetting an out of bounds origin
+Rect ClampRect(Rect rect, Size size);
+
+// The smallest rect that contains both |a| and |b|
+Rect UnionRect(const Rect& a, const Rect& b);
+
+// Merges rects that overlap or touch wherever their union costs no more area
+// than writing them separately, empty rects are dropped
+std::vector<Rect> CoalesceRects(std::vector<Rect> rects);
+
+}  // namespace graphics
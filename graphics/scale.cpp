@@ -0,0 +1,468 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "scale.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "worker_pool.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace graphics {
+
+namespace {
+// Target regions smaller than this aren't worth waking other threads for
+constexpr size_t kParallelMinBytes = 256 << 10;
+constexpr uint32_t kMinBandRows = 16;
+
+// Averages 2x2 blocks of the source rows |row0| and |row1| into |pixels|
+// RGBA pixels of |dst|. The rows are averaged first, then the columns, with
+// each average rounded up like pavgb.
+using HalveRowFn = void (*)(const char* row0,
+                            const char* row1,
+                            char* dst,
+                            size_t pixels);
+
+inline uint8_t avg(uint8_t a, uint8_t b) {
+  return (a + b + 1) >> 1;
+}
+
+void halve_scalar(const char* row0,
+                  const char* row1,
+                  char* dst,
+                  size_t pixels) {
+  const uint8_t* a = (const uint8_t*)row0;
+  const uint8_t* b = (const uint8_t*)row1;
+  uint8_t* out = (uint8_t*)dst;
+  for (size_t i = 0; i < pixels; ++i, a += 8, b += 8, out += 4) {
+    out[0] = avg(avg(a[2], b[2]), avg(a[6], b[6]));  // R
+    out[1] = avg(avg(a[1], b[1]), avg(a[5], b[5]));  // G
+    out[2] = avg(avg(a[0], b[0]), avg(a[4], b[4]));  // B
+    out[3] = avg(avg(a[3], b[3]), avg(a[7], b[7]));  // A
+  }
+}
+
+#if defined(AWRIT_X86)
+AWRIT_TARGET("ssse3")
+void halve_ssse3(const char* row0, const char* row1, char* dst, size_t pixels) {
+  const __m128i shuffle_mask =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i v = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + i * 8)),
+                             _mm_loadu_si128((const __m128i*)(row1 + i * 8)));
+    __m128i w =
+        _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + i * 8 + 16)),
+                     _mm_loadu_si128((const __m128i*)(row1 + i * 8 + 16)));
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(v), _mm_castsi128_ps(w),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(v), _mm_castsi128_ps(w),
+                                _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i pixel =
+        _mm_avg_epu8(_mm_castps_si128(even), _mm_castps_si128(odd));
+    _mm_storeu_si128((__m128i*)(dst + i * 4),
+                     _mm_shuffle_epi8(pixel, shuffle_mask));
+  }
+  halve_scalar(row0 + i * 8, row1 + i * 8, dst + i * 4, pixels - i);
+}
+
+AWRIT_TARGET("avx2")
+void halve_avx2(const char* row0, const char* row1, char* dst, size_t pixels) {
+  const __m256i shuffle_mask = _mm256_set_epi8(
+      31, 28, 29, 30, 27, 24, 25, 26, 23, 20, 21, 22, 19, 16, 17, 18, 15, 12,
+      13, 14, 11, 8, 9, 10, 7, 4, 5, 6, 3, 0, 1, 2);
+  size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i v = _mm256_avg_epu8(
+        _mm256_loadu_si256((const __m256i*)(row0 + i * 8)),
+        _mm256_loadu_si256((const __m256i*)(row1 + i * 8)));
+    __m256i w = _mm256_avg_epu8(
+        _mm256_loadu_si256((const __m256i*)(row0 + i * 8 + 32)),
+        _mm256_loadu_si256((const __m256i*)(row1 + i * 8 + 32)));
+    // Within each lane, so the pixels come out as 0 1 4 5 2 3 6 7
+    __m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(v),
+                                    _mm256_castsi256_ps(w),
+                                    _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 odd = _mm256_shuffle_ps(_mm256_castsi256_ps(v),
+                                   _mm256_castsi256_ps(w),
+                                   _MM_SHUFFLE(3, 1, 3, 1));
+    __m256i pixel =
+        _mm256_avg_epu8(_mm256_castps_si256(even), _mm256_castps_si256(odd));
+    pixel = _mm256_permute4x64_epi64(pixel, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i*)(dst + i * 4),
+                        _mm256_shuffle_epi8(pixel, shuffle_mask));
+  }
+  halve_scalar(row0 + i * 8, row1 + i * 8, dst + i * 4, pixels - i);
+}
+
+AWRIT_TARGET("avx512f,avx512bw")
+void halve_avx512(const char* row0,
+                  const char* row1,
+                  char* dst,
+                  size_t pixels) {
+  const __m512i shuffle_mask =
+      _mm512_set4_epi32(0x0f0c0d0e, 0x0b08090a, 0x07040506, 0x03000102);
+  const __m512i even_index = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16,
+                                               18, 20, 22, 24, 26, 28, 30);
+  const __m512i odd_index = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17,
+                                              19, 21, 23, 25, 27, 29, 31);
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    __m512i v = _mm512_avg_epu8(_mm512_loadu_si512(row0 + i * 8),
+                                _mm512_loadu_si512(row1 + i * 8));
+    __m512i w = _mm512_avg_epu8(_mm512_loadu_si512(row0 + i * 8 + 64),
+                                _mm512_loadu_si512(row1 + i * 8 + 64));
+    __m512i even = _mm512_permutex2var_epi32(v, even_index, w);
+    __m512i odd = _mm512_permutex2var_epi32(v, odd_index, w);
+    __m512i pixel = _mm512_avg_epu8(even, odd);
+    _mm512_storeu_si512(dst + i * 4, _mm512_shuffle_epi8(pixel, shuffle_mask));
+  }
+  halve_scalar(row0 + i * 8, row1 + i * 8, dst + i * 4, pixels - i);
+}
+#elif defined(AWRIT_NEON)
+void halve_neon(const char* row0, const char* row1, char* dst, size_t pixels) {
+  const uint8x16_t shuffle_mask = {2,  1, 0, 3,  6,  5,  4,  7,
+                                   10, 9, 8, 11, 14, 13, 12, 15};
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    // Splits even and odd pixels while loading
+    uint32x4x2_t a = vld2q_u32((const uint32_t*)(row0 + i * 8));
+    uint32x4x2_t b = vld2q_u32((const uint32_t*)(row1 + i * 8));
+    uint8x16_t even = vrhaddq_u8(vreinterpretq_u8_u32(a.val[0]),
+                                 vreinterpretq_u8_u32(b.val[0]));
+    uint8x16_t odd = vrhaddq_u8(vreinterpretq_u8_u32(a.val[1]),
+                                vreinterpretq_u8_u32(b.val[1]));
+    uint8x16_t pixel = vrhaddq_u8(even, odd);
+    vst1q_u8((uint8_t*)(dst + i * 4), vqtbl1q_u8(pixel, shuffle_mask));
+  }
+  halve_scalar(row0 + i * 8, row1 + i * 8, dst + i * 4, pixels - i);
+}
+#endif
+
+HalveRowFn select_halve() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return halve_avx512;
+    case Isa::AVX2:
+      return halve_avx2;
+    case Isa::SSSE3:
+      return halve_ssse3;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return halve_neon;
+#endif
+    default:
+      return halve_scalar;
+  }
+}
+
+// Adds |bytes| bytes of the source row |row| to the 16-bit sums in |sums|
+using AddRowFn = void (*)(const char* row, uint16_t* sums, size_t bytes);
+
+void add_row_scalar(const char* row, uint16_t* sums, size_t bytes) {
+  const uint8_t* in = (const uint8_t*)row;
+  for (size_t i = 0; i < bytes; ++i)
+    sums[i] += in[i];
+}
+
+#if defined(AWRIT_X86)
+AWRIT_TARGET("sse2")
+void add_row_sse2(const char* row, uint16_t* sums, size_t bytes) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i*)(row + i));
+    __m128i* out = (__m128i*)(sums + i);
+    _mm_storeu_si128(out, _mm_add_epi16(_mm_loadu_si128(out),
+                                        _mm_unpacklo_epi8(in, zero)));
+    _mm_storeu_si128(out + 1, _mm_add_epi16(_mm_loadu_si128(out + 1),
+                                            _mm_unpackhi_epi8(in, zero)));
+  }
+  add_row_scalar(row + i, sums + i, bytes - i);
+}
+
+AWRIT_TARGET("avx2")
+void add_row_avx2(const char* row, uint16_t* sums, size_t bytes) {
+  size_t i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    __m256i in =
+        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + i)));
+    __m256i* out = (__m256i*)(sums + i);
+    _mm256_storeu_si256(out, _mm256_add_epi16(_mm256_loadu_si256(out), in));
+  }
+  add_row_scalar(row + i, sums + i, bytes - i);
+}
+#elif defined(AWRIT_NEON)
+void add_row_neon(const char* row, uint16_t* sums, size_t bytes) {
+  size_t i = 0;
+  for (; i + 8 <= bytes; i += 8) {
+    uint8x8_t in = vld1_u8((const uint8_t*)(row + i));
+    vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), in));
+  }
+  add_row_scalar(row + i, sums + i, bytes - i);
+}
+#endif
+
+AddRowFn select_add_row() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+    case Isa::AVX2:
+      return add_row_avx2;
+    case Isa::SSSE3:
+      return add_row_sse2;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return add_row_neon;
+#endif
+    default:
+      return add_row_scalar;
+  }
+}
+
+// Source pixels [begin, end) covered by target pixel |index|
+struct Span {
+  uint32_t begin;
+  uint32_t end;
+};
+
+Span SpanOf(uint32_t index, uint32_t from, uint32_t to) {
+  uint32_t begin = static_cast<uint64_t>(index) * from / to;
+  uint32_t end = static_cast<uint64_t>(index + 1) * from / to;
+  return {begin, std::max(end, begin + 1)};
+}
+
+// The most source pixels that a target pixel covers along one axis
+uint32_t MaxSpan(uint32_t from, uint32_t to) {
+  return (from + to - 1) / to;
+}
+
+// Blocks of up to this many source pixels are averaged by the separable path,
+// which divides with a table of reciprocals
+constexpr uint32_t kMaxSeparableBlock = 1024;
+
+// Rounded averages of sums of |count| channel values, as
+// (sum + count / 2) * kReciprocals[count] >> 32. With sums below 2^18 and
+// counts below 2^13 this is exact.
+const uint64_t* Reciprocals() {
+  static const std::vector<uint64_t> reciprocals = [] {
+    std::vector<uint64_t> table(kMaxSeparableBlock + 1);
+    for (uint64_t count = 1; count <= kMaxSeparableBlock; ++count)
+      table[count] = ((uint64_t{1} << 32) + count - 1) / count;
+    return table;
+  }();
+  return reciprocals.data();
+}
+
+// Averages a box in two passes for each target row: the source rows it covers
+// are summed into 16-bit channel sums with SIMD, then the column spans of the
+// sums are added up and divided by a multiply. Same results as box_scale.
+void separable_scale(const char* src,
+                     size_t srcStride,
+                     Size srcSize,
+                     char* dst,
+                     Size dstSize,
+                     Rect rect,
+                     PixelFormat format,
+                     const std::vector<Span>& columns) {
+  static const AddRowFn add_row = select_add_row();
+  const uint64_t* reciprocals = Reciprocals();
+  const size_t bpp = bytes_per_pixel(format);
+  const size_t dstStride = dstSize.width * bpp;
+
+  // Only the source columns under |rect| are summed
+  const uint32_t first = columns.front().begin;
+  const size_t bytes =
+      static_cast<size_t>(columns.back().end - first) * BYTES_PER_PIXEL;
+  std::vector<uint16_t> sums(bytes);
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+    Span rows = SpanOf(y, srcSize.height, dstSize.height);
+    std::fill(sums.begin(), sums.end(), 0);
+    for (uint32_t sy = rows.begin; sy < rows.end; ++sy) {
+      add_row(src + sy * srcStride + first * BYTES_PER_PIXEL, sums.data(),
+              bytes);
+    }
+
+    const uint32_t height = rows.end - rows.begin;
+    uint8_t* out = (uint8_t*)(dst + y * dstStride + rect.x * bpp);
+    for (const Span& column : columns) {
+      const uint16_t* in = sums.data() + (column.begin - first) * 4;
+      uint32_t sum[4] = {in[0], in[1], in[2], in[3]};
+      for (uint32_t sx = column.begin + 1; sx < column.end; ++sx) {
+        in += 4;
+        sum[0] += in[0];
+        sum[1] += in[1];
+        sum[2] += in[2];
+        sum[3] += in[3];
+      }
+      const uint32_t count = height * (column.end - column.begin);
+      const uint64_t reciprocal = reciprocals[count];
+      auto average = [&](uint32_t value) {
+        return static_cast<uint8_t>(((value + count / 2) * reciprocal) >> 32);
+      };
+      out[0] = average(sum[2]);  // R
+      out[1] = average(sum[1]);  // G
+      out[2] = average(sum[0]);  // B
+      if (format == PixelFormat::RGBA)
+        out[3] = average(sum[3]);  // A
+      out += bpp;
+    }
+  }
+}
+
+void box_scale(const char* src,
+               size_t srcStride,
+               Size srcSize,
+               char* dst,
+               Size dstSize,
+               Rect rect,
+               PixelFormat format) {
+  const size_t bpp = bytes_per_pixel(format);
+  const size_t dstStride = dstSize.width * bpp;
+
+  std::vector<Span> columns(rect.width);
+  for (uint32_t x = 0; x < rect.width; ++x) {
+    columns[x] = SpanOf(rect.x + x, srcSize.width, dstSize.width);
+  }
+
+  // 16-bit sums hold up to 257 rows of a channel
+  const uint32_t maxRows = MaxSpan(srcSize.height, dstSize.height);
+  const uint32_t maxColumns = MaxSpan(srcSize.width, dstSize.width);
+  if (maxRows <= 257 && maxRows * maxColumns <= kMaxSeparableBlock) {
+    separable_scale(src, srcStride, srcSize, dst, dstSize, rect, format,
+                    columns);
+    return;
+  }
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+    Span rows = SpanOf(y, srcSize.height, dstSize.height);
+    uint8_t* out = (uint8_t*)(dst + y * dstStride + rect.x * bpp);
+    for (const Span& column : columns) {
+      uint32_t sum[4] = {};
+      for (uint32_t sy = rows.begin; sy < rows.end; ++sy) {
+        const uint8_t* in = (const uint8_t*)(src + sy * srcStride +
+                                             column.begin * BYTES_PER_PIXEL);
+        for (uint32_t sx = column.begin; sx < column.end; ++sx, in += 4) {
+          sum[0] += in[0];
+          sum[1] += in[1];
+          sum[2] += in[2];
+          sum[3] += in[3];
+        }
+      }
+      uint32_t count = (rows.end - rows.begin) * (column.end - column.begin);
+      out[0] = (sum[2] + count / 2) / count;  // R
+      out[1] = (sum[1] + count / 2) / count;  // G
+      out[2] = (sum[0] + count / 2) / count;  // B
+      if (format == PixelFormat::RGBA)
+        out[3] = (sum[3] + count / 2) / count;  // A
+      out += bpp;
+    }
+  }
+}
+
+}  // namespace
+
+Rect ScaleRect(Rect rect, Size from, Size to) {
+  rect = ClampRect(rect, from);
+  if (rect.empty() || to.width == 0 || to.height == 0)
+    return {};
+
+  auto begin = [](uint32_t value, uint32_t from, uint32_t to) {
+    return static_cast<uint32_t>(static_cast<uint64_t>(value) * to / from);
+  };
+  auto end = [](uint32_t value, uint32_t from, uint32_t to) {
+    return static_cast<uint32_t>(
+        (static_cast<uint64_t>(value) * to + from - 1) / from);
+  };
+  uint32_t x0 = begin(rect.x, from.width, to.width);
+  uint32_t y0 = begin(rect.y, from.height, to.height);
+  uint32_t x1 = end(rect.x + rect.width, from.width, to.width);
+  uint32_t y1 = end(rect.y + rect.height, from.height, to.height);
+  return ClampRect({x0, y0, std::max(x1, x0 + 1) - x0,
+                    std::max(y1, y0 + 1) - y0},
+                   to);
+}
+
+Rect SwizzleScaleRect(const char* src,
+                      size_t srcStride,
+                      Size srcSize,
+                      char* dst,
+                      Size dstSize,
+                      Rect rect,
+                      PixelFormat format) {
+  static const HalveRowFn halve_row = select_halve();
+
+  rect = ClampRect(rect, dstSize);
+  if (rect.empty())
+    return rect;
+
+  if (srcSize.width != dstSize.width * 2 ||
+      srcSize.height != dstSize.height * 2) {
+    box_scale(src, srcStride, srcSize, dst, dstSize, rect, format);
+    return rect;
+  }
+
+  const size_t bpp = bytes_per_pixel(format);
+  const size_t dstStride = dstSize.width * bpp;
+  // RGB rows are halved to RGBA first, then have their alpha dropped
+  std::vector<char> staging;
+  if (format == PixelFormat::RGB)
+    staging.resize(rect.width * BYTES_PER_PIXEL);
+
+  for (uint32_t y = rect.y; y < rect.y + rect.height; ++y) {
+    const char* row0 =
+        src + 2 * y * srcStride + 2 * rect.x * BYTES_PER_PIXEL;
+    char* out = dst + y * dstStride + rect.x * bpp;
+    if (format == PixelFormat::RGBA) {
+      halve_row(row0, row0 + srcStride, out, rect.width);
+      continue;
+    }
+
+    halve_row(row0, row0 + srcStride, staging.data(), rect.width);
+    for (uint32_t x = 0; x < rect.width; ++x, out += 3) {
+      std::memcpy(out, staging.data() + x * BYTES_PER_PIXEL, 3);
+    }
+  }
+  return rect;
+}
+
+Rect SwizzleScaleRectParallel(WorkerPool& pool,
+                              const char* src,
+                              size_t srcStride,
+                              Size srcSize,
+                              char* dst,
+                              Size dstSize,
+                              Rect rect,
+                              PixelFormat format) {
+  rect = ClampRect(rect, dstSize);
+  size_t bytes = rect.area() * bytes_per_pixel(format);
+  size_t bands =
+      std::min<size_t>(pool.concurrency(), rect.height / kMinBandRows);
+  if (bytes < kParallelMinBytes || bands < 2)
+    return SwizzleScaleRect(src, srcStride, srcSize, dst, dstSize, rect,
+                            format);
+
+  uint32_t rows = (rect.height + bands - 1) / bands;
+  pool.Run(bands, [&](size_t band) {
+    Rect part = rect;
+    part.y = rect.y + band * rows;
+    if (part.y >= rect.y + rect.height)
+      return;
+    part.height = std::min(rows, rect.y + rect.height - part.y);
+    SwizzleScaleRect(src, srcStride, srcSize, dst, dstSize, part, format);
+  });
+  return rect;
+}
+
+}  // namespace graphics
@@ -0,0 +1,45 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+
+#include "rect.h"
+#include "swizzle.h"
+
+namespace graphics {
+
+class WorkerPool;
+
+// Maps |rect| of a frame that is |from| onto a frame that is |to|, covering
+// every target pixel that any pixel of |rect| contributes to
+Rect ScaleRect(Rect rect, Size from, Size to);
+
+// Downscales the BGRA frame |src| that is |srcSize|, whose rows are
+// |srcStride| bytes apart, into |rect| of the tightly packed frame |dst| as
+// |format|, with |rect| and |dst| in |dstSize| coordinates. Each target pixel
+// is the average of the source pixels it covers, so only the target pixels are
+// written and the source is read once. Halving has its own SIMD kernels, other
+// ratios sum the source rows under each target row with SIMD first.
+// Returns |rect| clamped to |dstSize|.
+Rect SwizzleScaleRect(const char* src,
+                      size_t srcStride,
+                      Size srcSize,
+                      char* dst,
+                      Size dstSize,
+                      Rect rect,
+                      PixelFormat format = PixelFormat::RGBA);
+
+// Same as SwizzleScaleRect, but large regions are split into row bands that
+// are processed in parallel on |pool|
+Rect SwizzleScaleRectParallel(WorkerPool& pool,
+                              const char* src,
+                              size_t srcStride,
+                              Size srcSize,
+                              char* dst,
+                              Size dstSize,
+                              Rect rect,
+                              PixelFormat format = PixelFormat::RGBA);
+
+}  // namespace graphics
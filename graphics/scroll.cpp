@@ -0,0 +1,102 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "scroll.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace graphics {
+
+namespace {
+
+constexpr int32_t kRepeated = -1;
+
+// Rows that have to differ between the frames before a shift is looked for
+constexpr uint32_t kMinMovedRows = 4;
+
+// The rows that were scrolled in when |previous| moved by |dy|
+Rect ExposedBand(Size size, int32_t dy) {
+  if (dy >= 0)
+    return {0, 0, size.width, static_cast<uint32_t>(dy)};
+  return {0, size.height + dy, size.width, static_cast<uint32_t>(-dy)};
+}
+
+// Finds the runs of rows outside of the exposed band that |current| doesn't
+// match after shifting |previous| by |dy|, returning the rows that matched
+uint32_t Compare(const uint64_t* previous,
+                 const uint64_t* current,
+                 Size size,
+                 int32_t dy,
+                 std::vector<Rect>& changed) {
+  const int32_t height = size.height;
+  const int32_t begin = std::max(dy, 0);
+  const int32_t end = std::min(height, height + dy);
+  uint32_t matched = 0;
+  changed.clear();
+  for (int32_t y = begin; y < end; ++y) {
+    if (previous[y - dy] == current[y]) {
+      ++matched;
+      continue;
+    }
+    if (!changed.empty() && changed.back().y + changed.back().height ==
+                                static_cast<uint32_t>(y)) {
+      ++changed.back().height;
+    } else {
+      changed.push_back({0, static_cast<uint32_t>(y), size.width, 1});
+    }
+  }
+  return matched;
+}
+
+}  // namespace
+
+Scroll EstimateScroll(const uint64_t* previous,
+                      const uint64_t* current,
+                      Size size) {
+  Scroll result;
+  const int32_t height = size.height;
+  const uint32_t matched =
+      Compare(previous, current, size, 0, result.changed);
+  if (height - matched < kMinMovedRows)
+    return result;
+
+  std::unordered_map<uint64_t, int32_t> rows;
+  rows.reserve(height);
+  for (int32_t y = 0; y < height; ++y) {
+    auto inserted = rows.emplace(previous[y], y);
+    if (!inserted.second)
+      inserted.first->second = kRepeated;
+  }
+
+  // Each distinctive row votes for the shift that brings it to its new place
+  std::vector<uint32_t> votes(2 * height - 1);
+  for (int32_t y = 0; y < height; ++y) {
+    auto found = rows.find(current[y]);
+    if (found == rows.end() || found->second == kRepeated)
+      continue;
+    ++votes[y - found->second + height - 1];
+  }
+
+  int32_t best = 0;
+  for (int32_t i = 0; i < static_cast<int32_t>(votes.size()); ++i) {
+    if (votes[i] > votes[best + height - 1])
+      best = i - (height - 1);
+  }
+  if (best == 0 || votes[best + height - 1] < kMinMovedRows)
+    return result;
+
+  // The shift has to explain more of the frame than not moving at all
+  std::vector<Rect> changed;
+  if (Compare(previous, current, size, best, changed) <= matched)
+    return result;
+
+  result.dy = best;
+  result.exposed = ExposedBand(size, best);
+  result.changed = std::move(changed);
+  return result;
+}
+
+}  // namespace graphics
@@ -0,0 +1,30 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstdint>
+#include <vector>
+
+#include "rect.h"
+
+namespace graphics {
+
+struct Scroll {
+  // Rows the content moved by, positive when it moved down
+  int32_t dy = 0;
+  // Rows that were scrolled into view, spanning the whole width
+  Rect exposed;
+  // Runs of the other rows that don't match the moved content, such as
+  // sticky headers
+  std::vector<Rect> changed;
+};
+
+// Estimates the dominant vertical shift between two frames that are |size|
+// from the hashes of their rows, each |size.height| long.
+// Rows that repeat within the previous frame, such as blank ones, don't vote.
+Scroll EstimateScroll(const uint64_t* previous,
+                      const uint64_t* current,
+                      Size size);
+
+}  // namespace graphics
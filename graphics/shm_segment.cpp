@@ -0,0 +1,243 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "shm_segment.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <utility>
+
+#include "frame_stats.h"
+
+namespace graphics {
+
+namespace {
+
+inline void safe_close(int fd) {
+  while (close(fd) != 0 && errno == EINTR)
+    ;
+}
+
+int shm_create(const char* name) {
+  while (true) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd == -1 && errno == EINTR)
+      continue;
+    return fd;
+  }
+}
+
+size_t page_size() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+size_t page_align(size_t size) {
+  size = std::max(size, page_size());
+  return (size + page_size() - 1) & ~(page_size() - 1);
+}
+
+// PMD size on x86-64 and arm64 with 4K pages
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Faults in every page of a new mapping up front, keeping its contents
+void prefault(void* data, size_t size) {
+#ifdef __linux__
+  // Only has an effect before the pages are touched and when the kernel's
+  // shmem_enabled allows it
+  madvise(data, size, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+  // Linux 5.14+
+  if (madvise(data, size, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+#endif
+  madvise(data, size, MADV_WILLNEED);
+  volatile char* bytes = static_cast<char*>(data);
+  for (size_t i = 0; i < size; i += page_size())
+    bytes[i] = bytes[i];
+}
+
+}  // namespace
+
+ShmSegment::ShmSegment(std::string name, bool huge_pages)
+    : name_(std::move(name)), huge_pages_(huge_pages) {}
+
+ShmSegment::~ShmSegment() {
+  if (fd_ != -1)
+    Close();
+}
+
+ShmSegment::Status ShmSegment::Map(size_t size, bool grow) {
+  size = page_align(size);
+  if (huge_pages_ && size >= kHugePageSize)
+    size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+
+  if (mapped()) {
+    // The terminal unlinks the segment once it has read it, after which the
+    // mapping no longer refers to anything it can open by name
+    bool linked = Linked();
+    bool fits = grow ? size <= capacity_ && size >= capacity_ / 4
+                     : size == capacity_;
+    if (linked && fits) {
+      preserved_ = true;
+      return Status::Ok;
+    }
+
+    {
+      ScopedPhase phase(stats_, Phase::Unmap);
+      munmap(data_, capacity_);
+    }
+    data_ = nullptr;
+    if (!linked) {
+      safe_close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  size_t capacity = size;
+  // Grow by half again so that a window being dragged larger doesn't remap on
+  // every frame
+  if (grow && size > capacity_ && capacity_ != 0) {
+    size_t grown = capacity_ + capacity_ / 2;
+    grown = huge_pages_ ? (grown + kHugePageSize - 1) & ~(kHugePageSize - 1)
+                        : page_align(grown);
+    capacity = std::max(size, grown);
+  }
+
+  return Open(capacity);
+}
+
+void ShmSegment::Unmap() {
+  if (data_ != nullptr) {
+    ScopedPhase phase(stats_, Phase::Unmap);
+    munmap(data_, capacity_);
+    data_ = nullptr;
+  }
+  if (fd_ != -1) {
+    safe_close(fd_);
+    fd_ = -1;
+  }
+}
+
+void ShmSegment::Close() {
+  Unmap();
+  capacity_ = 0;
+  shm_unlink(name_.c_str());
+}
+
+ShmSegment::Status ShmSegment::Open(size_t capacity) {
+  const char* name = name_.c_str();
+  preserved_ = false;
+  if (stats_ != nullptr)
+    ++stats_->remaps;
+  if (fd_ == -1) {
+    ScopedPhase phase(stats_, Phase::Open);
+    fd_ = shm_create(name);
+    if (fd_ == -1) {
+      perror("shm_open");
+      return Status::OpenFailed;
+    }
+  }
+
+  struct stat st;
+  bool sized =
+      fstat(fd_, &st) == 0 && static_cast<size_t>(st.st_size) == capacity;
+  if (!sized) {
+    ScopedPhase phase(stats_, Phase::Resize);
+#ifdef __APPLE__
+    // macOS can only run truncate on shared memory _once_, it needs to be
+    // unlinked first:
+    // https://github.com/apple/darwin-xnu/blob/a1babec6b135d1f35b2590a1990af3c5c5393479/bsd/kern/posix_shm.c#L523-L527
+    safe_close(fd_);
+    shm_unlink(name);
+    fd_ = shm_create(name);
+    if (fd_ == -1) {
+      perror("shm_open");
+      return Status::OpenFailed;
+    }
+#endif
+    if (ftruncate(fd_, capacity) == -1) {
+      perror("ftruncate");
+      safe_close(fd_);
+      fd_ = -1;
+      return Status::ResizeFailed;
+    }
+  }
+
+  ScopedPhase phase(stats_, Phase::Map);
+  void* ptr =
+      mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (ptr == MAP_FAILED) {
+    perror("mmap");
+    safe_close(fd_);
+    fd_ = -1;
+    return Status::MapFailed;
+  }
+
+  if (huge_pages_)
+    prefault(ptr, capacity);
+
+  data_ = ptr;
+  capacity_ = capacity;
+  preserved_ = sized;
+  return Status::Ok;
+}
+
+bool ShmSegment::HugePagesMapped() const {
+#ifdef __linux__
+  if (data_ == nullptr)
+    return false;
+  FILE* smaps = fopen("/proc/self/smaps", "re");
+  if (smaps == nullptr)
+    return false;
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(data_);
+  bool inside = false;
+  bool huge = false;
+  char line[256];
+  while (fgets(line, sizeof(line), smaps) != nullptr) {
+    uintptr_t from, to;
+    // Each mapping starts with its address range, followed by its fields
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &from, &to) == 2) {
+      if (inside)
+        break;
+      inside = from == start;
+      continue;
+    }
+    size_t kb = 0;
+    if (inside && sscanf(line, "ShmemPmdMapped: %zu kB", &kb) == 1 &&
+        kb > 0) {
+      huge = true;
+      break;
+    }
+  }
+  fclose(smaps);
+  return huge;
+#else
+  return false;
+#endif
+}
+
+bool ShmSegment::Linked() const {
+#ifdef __linux__
+  struct stat st;
+  return fstat(fd_, &st) == 0 && st.st_nlink > 0;
+#else
+  int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+  if (fd == -1)
+    return errno != ENOENT;
+  safe_close(fd);
+  return true;
+#endif
+}
+
+}  // namespace graphics
@@ -0,0 +1,65 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+#include <string>
+
+namespace graphics {
+
+struct FrameStats;
+
+// A named POSIX shared memory object and its mapping into this process.
+class ShmSegment {
+ public:
+  enum class Status { Ok, OpenFailed, ResizeFailed, MapFailed };
+
+  // With |huge_pages|, mappings are sized and advised for transparent huge
+  // pages and prefaulted when they are created, so that the first frame
+  // written to them doesn't pay for thousands of page faults
+  explicit ShmSegment(std::string name, bool huge_pages = false);
+  ~ShmSegment();
+
+  ShmSegment(const ShmSegment&) = delete;
+  ShmSegment& operator=(const ShmSegment&) = delete;
+
+  // Ensures at least |size| bytes are mapped.
+  // When |grow| is set, an existing mapping is reused while it is large enough
+  // and grows geometrically, otherwise the segment is sized to exactly |size|.
+  Status Map(size_t size, bool grow);
+
+  // Unmaps and closes the segment, leaving the name linked so that the
+  // terminal can still open it.
+  void Unmap();
+
+  // Unmaps, closes and unlinks the segment.
+  void Close();
+
+  char* data() const { return static_cast<char*>(data_); }
+  size_t capacity() const { return capacity_; }
+  bool mapped() const { return data_ != nullptr; }
+  // Whether the previous contents survived the last call to Map
+  bool preserved() const { return preserved_; }
+  // Whether the current mapping is backed by huge pages, which depends on the
+  // kernel's shmem settings. Slow, it reads the process's memory map.
+  bool HugePagesMapped() const;
+  const std::string& name() const { return name_; }
+
+  // Times opening, resizing, mapping and unmapping into |stats| while set
+  void set_stats(FrameStats* stats) { stats_ = stats; }
+
+ private:
+  Status Open(size_t capacity);
+  bool Linked() const;
+
+  std::string name_;
+  int fd_ = -1;
+  void* data_ = nullptr;
+  size_t capacity_ = 0;
+  bool preserved_ = false;
+  bool huge_pages_ = false;
+  FrameStats* stats_ = nullptr;
+};
+
+}  // namespace graphics
@@ -0,0 +1,388 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "swizzle.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "hash.h"
+#include "worker_pool.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace graphics {
+
+namespace {
+// Regions smaller than this aren't worth waking other threads for
+constexpr size_t kParallelMinBytes = 1 << 20;
+constexpr uint32_t kMinBandRows = 16;
+
+std::atomic<size_t> streaming_threshold{kDefaultStreamingThreshold};
+
+// Swizzles |pixels| BGRA pixels from |src| to RGBA in |dst|, the last block
+// of a row is handled without reading or writing past it
+using SwizzleRowFn = void (*)(const char* src, char* dst, size_t pixels);
+
+void swizzle_scalar(const char* src, char* dst, size_t pixels) {
+  for (size_t i = 0; i < pixels * 4; i += 4) {
+    dst[i] = src[i + 2];      // R
+    dst[i + 1] = src[i + 1];  // G
+    dst[i + 2] = src[i];      // B
+    dst[i + 3] = src[i + 3];  // A
+  }
+}
+
+#if defined(AWRIT_X86)
+AWRIT_TARGET("ssse3")
+void swizzle_ssse3(const char* src, char* dst, size_t pixels) {
+  const __m128i shuffle_mask =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    _mm_storeu_si128((__m128i*)(dst + i * 4),
+                     _mm_shuffle_epi8(pixels, shuffle_mask));
+  }
+  swizzle_scalar(src + i * 4, dst + i * 4, pixels - i);
+}
+
+AWRIT_TARGET("avx2")
+void swizzle_avx2(const char* src, char* dst, size_t pixels) {
+  const __m256i shuffle_mask = _mm256_set_epi8(
+      31, 28, 29, 30, 27, 24, 25, 26, 23, 20, 21, 22, 19, 16, 17, 18, 15, 12,
+      13, 14, 11, 8, 9, 10, 7, 4, 5, 6, 3, 0, 1, 2);
+  size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    __m256i shuffled = _mm256_shuffle_epi8(pixels, shuffle_mask);
+    _mm256_storeu_si256((__m256i*)(dst + i * 4), shuffled);
+  }
+  if (i < pixels) {
+    // Masked lanes are neither loaded nor stored, so they can't fault
+    const __m256i tail = _mm256_cmpgt_epi32(
+        _mm256_set1_epi32(pixels - i),
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i pixels = _mm256_maskload_epi32((const int*)(src + i * 4), tail);
+    _mm256_maskstore_epi32((int*)(dst + i * 4), tail,
+                           _mm256_shuffle_epi8(pixels, shuffle_mask));
+  }
+}
+
+AWRIT_TARGET("avx512f,avx512bw")
+void swizzle_avx512(const char* src, char* dst, size_t pixels) {
+  // vpshufb works within 128-bit lanes, so the same mask is used for each
+  const __m512i shuffle_mask =
+      _mm512_set4_epi32(0x0f0c0d0e, 0x0b08090a, 0x07040506, 0x03000102);
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    __m512i pixels = _mm512_loadu_si512(src + i * 4);
+    _mm512_storeu_si512(dst + i * 4, _mm512_shuffle_epi8(pixels, shuffle_mask));
+  }
+  if (i < pixels) {
+    __mmask16 tail = (1u << (pixels - i)) - 1;
+    __m512i pixels = _mm512_maskz_loadu_epi32(tail, src + i * 4);
+    _mm512_mask_storeu_epi32(dst + i * 4, tail,
+                             _mm512_shuffle_epi8(pixels, shuffle_mask));
+  }
+}
+
+// Same as the swizzle kernels, but the aligned body of the row is written
+// with non-temporal stores that bypass the cache. The caller has to fence.
+AWRIT_TARGET("ssse3")
+void stream_ssse3(const char* src, char* dst, size_t pixels) {
+  const __m128i shuffle_mask =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = std::min(pixels, (-reinterpret_cast<uintptr_t>(dst) & 15) / 4);
+  swizzle_ssse3(src, dst, i);
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    _mm_stream_si128((__m128i*)(dst + i * 4),
+                     _mm_shuffle_epi8(pixels, shuffle_mask));
+  }
+  swizzle_ssse3(src + i * 4, dst + i * 4, pixels - i);
+}
+
+AWRIT_TARGET("avx2")
+void stream_avx2(const char* src, char* dst, size_t pixels) {
+  const __m256i shuffle_mask = _mm256_set_epi8(
+      31, 28, 29, 30, 27, 24, 25, 26, 23, 20, 21, 22, 19, 16, 17, 18, 15, 12,
+      13, 14, 11, 8, 9, 10, 7, 4, 5, 6, 3, 0, 1, 2);
+  size_t i = std::min(pixels, (-reinterpret_cast<uintptr_t>(dst) & 31) / 4);
+  swizzle_avx2(src, dst, i);
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    _mm256_stream_si256((__m256i*)(dst + i * 4),
+                        _mm256_shuffle_epi8(pixels, shuffle_mask));
+  }
+  swizzle_avx2(src + i * 4, dst + i * 4, pixels - i);
+}
+
+AWRIT_TARGET("avx512f,avx512bw")
+void stream_avx512(const char* src, char* dst, size_t pixels) {
+  const __m512i shuffle_mask =
+      _mm512_set4_epi32(0x0f0c0d0e, 0x0b08090a, 0x07040506, 0x03000102);
+  size_t i = std::min(pixels, (-reinterpret_cast<uintptr_t>(dst) & 63) / 4);
+  swizzle_avx512(src, dst, i);
+  for (; i + 16 <= pixels; i += 16) {
+    __m512i pixels = _mm512_loadu_si512(src + i * 4);
+    _mm512_stream_si512((__m512i*)(dst + i * 4),
+                        _mm512_shuffle_epi8(pixels, shuffle_mask));
+  }
+  swizzle_avx512(src + i * 4, dst + i * 4, pixels - i);
+}
+#elif defined(AWRIT_NEON)
+void swizzle_neon(const char* src, char* dst, size_t pixels) {
+  const uint8x16_t shuffle_mask = {2,  1, 0, 3,  6,  5,  4,  7,
+                                   10, 9, 8, 11, 14, 13, 12, 15};
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    uint8x16_t pixels = vld1q_u8((const uint8_t*)(src + i * 4));
+    uint8x16_t shuffled = vqtbl1q_u8(pixels, shuffle_mask);
+    vst1q_u8((uint8_t*)(dst + i * 4), shuffled);
+  }
+  swizzle_scalar(src + i * 4, dst + i * 4, pixels - i);
+}
+#endif
+
+// Swizzles |pixels| BGRA pixels from |src| to packed RGB in |dst|, writing
+// exactly 3 bytes per pixel
+using PackRowFn = void (*)(const char* src, char* dst, size_t pixels);
+
+void pack_rgb_scalar(const char* src, char* dst, size_t pixels) {
+  for (size_t i = 0; i < pixels; ++i, src += 4, dst += 3) {
+    dst[0] = src[2];  // R
+    dst[1] = src[1];  // G
+    dst[2] = src[0];  // B
+  }
+}
+
+#if defined(AWRIT_X86)
+AWRIT_TARGET("ssse3")
+void pack_rgb_ssse3(const char* src, char* dst, size_t pixels) {
+  const __m128i shuffle_mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                             13, 12, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i * 4));
+    __m128i packed = _mm_shuffle_epi8(pixels, shuffle_mask);
+    // 12 bytes, so the pixels after the row are left alone
+    _mm_storel_epi64((__m128i*)(dst + i * 3), packed);
+    int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    std::memcpy(dst + i * 3 + 8, &last, sizeof(last));
+  }
+  pack_rgb_scalar(src + i * 4, dst + i * 3, pixels - i);
+}
+
+AWRIT_TARGET("avx2")
+void pack_rgb_avx2(const char* src, char* dst, size_t pixels) {
+  const __m256i shuffle_mask = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5,
+      4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  // Joins the 12 bytes of each lane
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  const __m256i store_mask = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+  size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+    __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(pixels, shuffle_mask), lanes);
+    _mm256_maskstore_epi32((int*)(dst + i * 3), store_mask, packed);
+  }
+  pack_rgb_scalar(src + i * 4, dst + i * 3, pixels - i);
+}
+
+AWRIT_TARGET("avx512f,avx512bw")
+void pack_rgb_avx512(const char* src, char* dst, size_t pixels) {
+  const __m512i shuffle_mask = _mm512_set4_epi32(-1, 0x0c0d0e08, 0x090a0405,
+                                                 0x06000102);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13,
+                                          14, 15, 15, 15, 15);
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    __m512i pixels = _mm512_loadu_si512(src + i * 4);
+    __m512i packed = _mm512_maskz_permutexvar_epi32(
+        0xffff, lanes, _mm512_shuffle_epi8(pixels, shuffle_mask));
+    _mm512_mask_storeu_epi8(dst + i * 3, (1ULL << 48) - 1, packed);
+  }
+  pack_rgb_scalar(src + i * 4, dst + i * 3, pixels - i);
+}
+#elif defined(AWRIT_NEON)
+void pack_rgb_neon(const char* src, char* dst, size_t pixels) {
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    uint8x16x4_t bgra = vld4q_u8((const uint8_t*)(src + i * 4));
+    uint8x16x3_t rgb = {{bgra.val[2], bgra.val[1], bgra.val[0]}};
+    vst3q_u8((uint8_t*)(dst + i * 3), rgb);
+  }
+  pack_rgb_scalar(src + i * 4, dst + i * 3, pixels - i);
+}
+#endif
+
+PackRowFn select_pack_rgb() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return pack_rgb_avx512;
+    case Isa::AVX2:
+      return pack_rgb_avx2;
+    case Isa::SSSE3:
+      return pack_rgb_ssse3;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return pack_rgb_neon;
+#endif
+    default:
+      return pack_rgb_scalar;
+  }
+}
+
+SwizzleRowFn select_swizzle() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return swizzle_avx512;
+    case Isa::AVX2:
+      return swizzle_avx2;
+    case Isa::SSSE3:
+      return swizzle_ssse3;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return swizzle_neon;
+#endif
+    default:
+      return swizzle_scalar;
+  }
+}
+
+// Null when there are no non-temporal stores to use
+SwizzleRowFn select_stream() {
+  switch (ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+      return stream_avx512;
+    case Isa::AVX2:
+      return stream_avx2;
+    case Isa::SSSE3:
+      return stream_ssse3;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+// Whether |rect| is large enough that writing it through the cache would
+// only evict the working set of the rest of the process
+bool should_stream(Rect rect, PixelFormat format, const uint64_t* row_hashes) {
+  static const SwizzleRowFn stream_row = select_stream();
+  size_t threshold = streaming_threshold.load(std::memory_order_relaxed);
+  // Packed RGB isn't streamed, and hashed rows are read back right away
+  return stream_row != nullptr && threshold != 0 &&
+         format == PixelFormat::RGBA && row_hashes == nullptr &&
+         rect.area() * BYTES_PER_PIXEL >= threshold;
+}
+
+void swizzle_rows(const char* src,
+                  size_t stride,
+                  char* dst,
+                  Size size,
+                  Rect rect,
+                  PixelFormat format,
+                  uint64_t* row_hashes,
+                  bool stream) {
+  static const SwizzleRowFn swizzle_row = select_swizzle();
+  static const SwizzleRowFn stream_row = select_stream();
+  static const PackRowFn pack_rgb_row = select_pack_rgb();
+
+  const PixelFormat rgb = PixelFormat::RGB;
+  const size_t bpp = bytes_per_pixel(format);
+  const char* in = src + rect.y * stride + rect.x * BYTES_PER_PIXEL;
+  char* out = dst + (static_cast<size_t>(rect.y) * size.width + rect.x) * bpp;
+  if (rect.x != 0 || rect.width != size.width)
+    row_hashes = nullptr;
+
+  // Only the pixels of |rect| are touched, so the source can end right after
+  // its last pixel
+  for (uint32_t y = 0; y < rect.height; y++) {
+    if (format == rgb) {
+      pack_rgb_row(in, out, rect.width);
+    } else if (stream) {
+      stream_row(in, out, rect.width);
+    } else {
+      swizzle_row(in, out, rect.width);
+    }
+    if (row_hashes != nullptr)
+      row_hashes[rect.y + y] = HashBytes(out, rect.width * bpp);
+    in += stride;
+    out += size.width * bpp;
+  }
+
+#if defined(AWRIT_X86)
+  // Non-temporal stores are weakly ordered, they have to be visible before
+  // the frame is handed to the terminal
+  if (stream)
+    _mm_sfence();
+#endif
+}
+
+}  // namespace
+
+void SetStreamingThreshold(size_t bytes) {
+  streaming_threshold.store(bytes, std::memory_order_relaxed);
+}
+
+size_t StreamingThreshold() {
+  return streaming_threshold.load(std::memory_order_relaxed);
+}
+
+Rect SwizzleRect(const char* src,
+                 size_t stride,
+                 char* dst,
+                 Size size,
+                 Rect rect,
+                 PixelFormat format,
+                 uint64_t* row_hashes) {
+  swizzle_rows(src, stride, dst, size, rect, format, row_hashes,
+               should_stream(rect, format, row_hashes));
+  return rect;
+}
+
+Rect SwizzleRectParallel(WorkerPool& pool,
+                         const char* src,
+                         size_t stride,
+                         char* dst,
+                         Size size,
+                         Rect rect,
+                         PixelFormat format,
+                         uint64_t* row_hashes) {
+  size_t bytes =
+      static_cast<size_t>(rect.width) * rect.height * BYTES_PER_PIXEL;
+  size_t bands =
+      std::min<size_t>(pool.concurrency(), rect.height / kMinBandRows);
+  if (bytes < kParallelMinBytes || bands < 2)
+    return SwizzleRect(src, stride, dst, size, rect, format, row_hashes);
+
+  // Decided for the whole region, each band is below the threshold
+  bool stream = should_stream(rect, format, row_hashes);
+
+  uint32_t rows = (rect.height + bands - 1) / bands;
+  pool.Run(bands, [&](size_t band) {
+    Rect part = rect;
+    part.y = rect.y + band * rows;
+    if (part.y >= rect.y + rect.height)
+      return;
+    part.height = std::min(rows, rect.y + rect.height - part.y);
+    swizzle_rows(src, stride, dst, size, part, format, row_hashes, stream);
+  });
+
+  return rect;
+}
+
+}  // namespace graphics
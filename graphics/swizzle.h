@@ -0,0 +1,87 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_features.h"
+#include "rect.h"
+
+namespace graphics {
+
+class WorkerPool;
+
+// Frames are padded to the block size of the widest kernel that can be
+// selected at runtime, so that sizes don't depend on the CPU
+#if defined(AWRIT_X86)
+constexpr size_t ALIGNMENT = 64;  // AVX-512 alignment
+#elif defined(AWRIT_NEON)
+constexpr size_t ALIGNMENT = 16;  // NEON alignment
+#else
+constexpr size_t ALIGNMENT = 4;  // Default alignment
+#endif
+
+constexpr size_t BYTES_PER_PIXEL = 4;
+
+// Layouts that frames can be written in, named after kitty's f= values
+enum class PixelFormat { RGBA = 32, RGB = 24 };
+
+constexpr size_t bytes_per_pixel(PixelFormat format) {
+  return format == PixelFormat::RGB ? 3 : 4;
+}
+
+// Helper function to align size to the required SIMD alignment
+constexpr size_t align_size(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Size of a tightly packed BGRA frame
+constexpr size_t frame_bytes(Size size) {
+  return static_cast<size_t>(size.width) * size.height * BYTES_PER_PIXEL;
+}
+
+// Size of a tightly packed frame in |format|, aligned to the SIMD block size
+constexpr size_t frame_size(Size size,
+                            PixelFormat format = PixelFormat::RGBA) {
+  return align_size(
+      static_cast<size_t>(size.width) * size.height * bytes_per_pixel(format),
+      ALIGNMENT);
+}
+
+// Regions of at least this many RGBA bytes are written with non-temporal
+// stores where the CPU has them, since the segment is only read by the
+// terminal and caching it would evict everything else. 0 turns it off.
+constexpr size_t kDefaultStreamingThreshold = 4 << 20;
+
+void SetStreamingThreshold(size_t bytes);
+size_t StreamingThreshold();
+
+// Copies |rect| of the BGRA frame |src|, whose rows are |stride| bytes apart,
+// into the same position of the tightly packed frame |dst| that is |size|, as
+// RGBA (swap R and B channels) or as packed RGB without alpha.
+// Exactly |rect| is read and written, the returned rect is the region that
+// was written.
+// When |row_hashes| is set and |rect| spans whole rows, the HashBytes of each
+// written row is stored at its y while the row is still in cache.
+Rect SwizzleRect(const char* src,
+                 size_t stride,
+                 char* dst,
+                 Size size,
+                 Rect rect,
+                 PixelFormat format = PixelFormat::RGBA,
+                 uint64_t* row_hashes = nullptr);
+
+// Same as SwizzleRect, but large regions are split into row bands that are
+// processed in parallel on |pool|
+Rect SwizzleRectParallel(WorkerPool& pool,
+                         const char* src,
+                         size_t stride,
+                         char* dst,
+                         Size size,
+                         Rect rect,
+                         PixelFormat format = PixelFormat::RGBA,
+                         uint64_t* row_hashes = nullptr);
+
+}  // namespace graphics
@@ -0,0 +1,160 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "tile_cache.h"
+
+#include <algorithm>
+
+#include "hash.h"
+#include "swizzle.h"
+
+namespace graphics {
+
+TileCache::TileCache(uint32_t tile_size, size_t capacity, uint32_t first_id)
+    : tile_size_(tile_size),
+      capacity_(capacity),
+      first_id_(first_id),
+      next_id_(first_id) {}
+
+size_t TileCache::SegmentSize(Size size) const {
+  size_t columns = (size.width + tile_size_ - 1) / tile_size_;
+  size_t rows = (size.height + tile_size_ - 1) / tile_size_;
+  return columns * rows * tile_size_ * tile_size_ * BYTES_PER_PIXEL;
+}
+
+std::vector<TileCache::Tile> TileCache::Write(const char* src,
+                                              size_t stride,
+                                              Size size,
+                                              Rect rect,
+                                              char* dst) {
+  std::vector<Tile> tiles;
+  ++write_;
+  rect = ClampRect(rect, size);
+  if (rect.empty())
+    return tiles;
+
+  const size_t tile_bytes =
+      static_cast<size_t>(tile_size_) * tile_size_ * BYTES_PER_PIXEL;
+  const uint32_t columns = (size.width + tile_size_ - 1) / tile_size_;
+  const uint32_t rows = (size.height + tile_size_ - 1) / tile_size_;
+  if (size.width != size_.width || size.height != size_.height) {
+    for (uint64_t hash : grid_) {
+      if (hash != 0)
+        --index_[hash]->uses;
+    }
+    grid_.assign(static_cast<size_t>(columns) * rows, 0);
+    size_ = size;
+  }
+  const uint32_t first_column = rect.x / tile_size_;
+  const uint32_t last_column = (rect.x + rect.width - 1) / tile_size_;
+  const uint32_t first_row = rect.y / tile_size_;
+  const uint32_t last_row = (rect.y + rect.height - 1) / tile_size_;
+  tiles.reserve(static_cast<size_t>(last_column - first_column + 1) *
+                (last_row - first_row + 1));
+
+  for (uint32_t row = first_row; row <= last_row; ++row) {
+    for (uint32_t column = first_column; column <= last_column; ++column) {
+      Tile tile;
+      tile.rect.x = column * tile_size_;
+      tile.rect.y = row * tile_size_;
+      tile.rect.width = std::min(tile_size_, size.width - tile.rect.x);
+      tile.rect.height = std::min(tile_size_, size.height - tile.rect.y);
+      const size_t index = static_cast<size_t>(row) * columns + column;
+      tile.offset = index * tile_bytes;
+
+      // Each row is hashed right after it is swizzled, while it's still in
+      // L1, so the frame is only read once
+      const Size tile_size{tile.rect.width, tile.rect.height};
+      const size_t row_bytes =
+          static_cast<size_t>(tile.rect.width) * BYTES_PER_PIXEL;
+      const char* origin = src + tile.rect.y * stride +
+                           static_cast<size_t>(tile.rect.x) * BYTES_PER_PIXEL;
+      char* out = dst + tile.offset;
+      Hasher hasher;
+      for (uint32_t y = 0; y < tile.rect.height; ++y) {
+        char* line = out + y * row_bytes;
+        SwizzleRect(origin + y * stride, stride, line,
+                    {tile.rect.width, 1}, {0, 0, tile.rect.width, 1});
+        hasher.Update(line, row_bytes);
+      }
+      // Edge tiles with the same bytes but a different shape aren't the same
+      const uint64_t shape = (static_cast<uint64_t>(tile_size.width) << 32) |
+                             tile_size.height;
+      hasher.Update(reinterpret_cast<const char*>(&shape), sizeof(shape));
+
+      tile.hash = hasher.Digest();
+      tile.id = Lookup(tile.hash, tile.fresh);
+      Show(index, tile.hash);
+      tiles.push_back(tile);
+    }
+  }
+  return tiles;
+}
+
+uint32_t TileCache::Lookup(uint64_t hash, bool& fresh) {
+  auto found = index_.find(hash);
+  if (found != index_.end()) {
+    Entry& entry = *found->second;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    // Sent again until a transmission is confirmed, the terminal may not
+    // have the contents yet, but only once per frame
+    fresh = entry.state != State::kSent && entry.fresh_write != write_;
+    if (fresh) {
+      entry.state = State::kPending;
+      entry.fresh_write = write_;
+    }
+    return entry.id;
+  }
+
+  fresh = true;
+  uint32_t id = 0;
+  // Replacing an id that is on screen would change what's shown, and a late
+  // confirmation of a pending id would be taken for its new contents, so the
+  // cache grows past capacity rather than evict those
+  if (entries_.size() >= capacity_) {
+    auto victim = std::find_if(
+        entries_.rbegin(), entries_.rend(), [](const Entry& entry) {
+          return !entry.uses && entry.state != State::kPending;
+        });
+    if (victim != entries_.rend()) {
+      id = victim->id;
+      index_.erase(victim->hash);
+      entries_.erase(std::next(victim).base());
+    }
+  }
+  if (id == 0)
+    id = next_id_++;
+  entries_.push_front({hash, id, 0, State::kPending, write_});
+  index_[hash] = entries_.begin();
+  ids_[id] = entries_.begin();
+  return id;
+}
+
+void TileCache::Show(size_t index, uint64_t hash) {
+  uint64_t& shown = grid_[index];
+  if (shown == hash)
+    return;
+  if (shown != 0)
+    --index_[shown]->uses;
+  ++index_[hash]->uses;
+  shown = hash;
+}
+
+void TileCache::Confirm(uint32_t id, bool transmitted) {
+  auto found = ids_.find(id);
+  if (found == ids_.end() || found->second->state != State::kPending)
+    return;
+  found->second->state = transmitted ? State::kSent : State::kUnsent;
+}
+
+void TileCache::Clear() {
+  entries_.clear();
+  index_.clear();
+  ids_.clear();
+  grid_.clear();
+  size_ = {};
+  next_id_ = first_id_;
+}
+
+}  // namespace graphics
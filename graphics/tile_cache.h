@@ -0,0 +1,108 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "rect.h"
+
+namespace graphics {
+
+// Splits frames into square tiles and remembers which kitty image id holds
+// the contents of each tile that was transmitted, so that repeated content
+// (scrolling, blinking, tabs switching back) is placed by id instead of sent
+// again.
+// Tiles are written to the buffer in tile order, each one tightly packed as
+// RGBA at a fixed offset.
+// A new hash is only treated as cached once its transmission is confirmed,
+// until then it stays fresh on every frame that shows it.
+class TileCache {
+ public:
+  struct Tile {
+    Rect rect;           // in frame pixels
+    uint64_t hash = 0;   // of the tile's pixels and size
+    uint32_t id = 0;     // kitty image id
+    size_t offset = 0;   // bytes into the segment
+    bool fresh = false;  // must be transmitted to |id| before it is placed
+  };
+
+  enum class State {
+    kUnsent,   // transmission failed or wasn't attempted
+    kPending,  // handed out as fresh, waiting to be confirmed
+    kSent,     // the terminal holds the contents
+  };
+
+  // Ids are handed out from |first_id| on, at most |capacity| of them are
+  // remembered before the least recently used ones are reused
+  TileCache(uint32_t tile_size, size_t capacity, uint32_t first_id);
+
+  // Bytes needed to hold every tile of a frame that is |size|
+  size_t SegmentSize(Size size) const;
+
+  // Swizzles every tile of the BGRA frame |src| that is |size| and overlaps
+  // |rect| into its place in |dst|, hashing it while it's in cache, then looks
+  // it up. |dst| must hold SegmentSize bytes.
+  std::vector<Tile> Write(const char* src,
+                          size_t stride,
+                          Size size,
+                          Rect rect,
+                          char* dst);
+
+  // Records whether the fresh tile last handed out for |id| was transmitted.
+  // Pending ids are never reused, so every fresh tile should be confirmed one
+  // way or the other.
+  void Confirm(uint32_t id, bool transmitted);
+
+  // Calls |fn| with every id that is waiting to be confirmed
+  template <typename Fn>
+  void ForEachPending(Fn fn) const {
+    for (const Entry& entry : entries_) {
+      if (entry.state == State::kPending)
+        fn(entry.id);
+    }
+  }
+
+  // Forgets every id, for when the terminal's images were deleted
+  void Clear();
+
+  uint32_t tile_size() const { return tile_size_; }
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    uint32_t id;
+    uint32_t uses;  // tiles on screen that show the entry
+    State state;
+    uint32_t fresh_write;  // the last Write that handed it out as fresh
+  };
+
+  // Returns the id for |hash|, |fresh| is set when it wasn't cached and no
+  // earlier tile of the same Write is already transmitting it
+  uint32_t Lookup(uint64_t hash, bool& fresh);
+
+  // Records that the tile at |index| of the grid now shows |hash|
+  void Show(size_t index, uint64_t hash);
+
+  uint32_t tile_size_;
+  size_t capacity_;
+  uint32_t first_id_;
+  uint32_t next_id_;
+  // Counts calls to Write, so that repeats of a tile within one are placed
+  uint32_t write_ = 0;
+  Size size_;
+  // Hash shown by each tile of the last frame, 0 when unknown
+  std::vector<uint64_t> grid_;
+  // Most recently used first
+  std::list<Entry> entries_;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> ids_;
+};
+
+}  // namespace graphics
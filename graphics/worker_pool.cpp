@@ -0,0 +1,90 @@
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include "worker_pool.h"
+
+#include <algorithm>
+
+namespace graphics {
+
+namespace {
+constexpr size_t kMaxThreads = 7;
+}  // namespace
+
+WorkerPool& WorkerPool::Shared() {
+  static WorkerPool* pool = new WorkerPool(std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u) - 1, kMaxThreads));
+  return *pool;
+}
+
+WorkerPool::WorkerPool(size_t threads) {
+  threads_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i)
+    threads_.emplace_back(&WorkerPool::Loop, this);
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+void WorkerPool::Run(size_t count, const std::function<void(size_t)>& task) {
+  std::lock_guard<std::mutex> run_lock(run_mutex_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  count_ = count;
+  next_ = 0;
+  remaining_ = count;
+  count_faults_ = ScopedFaults::Active();
+  faults_ = Faults();
+  wake_.notify_all();
+
+  // The caller works through the tasks too instead of waiting idle
+  while (next_ < count_) {
+    size_t index = next_++;
+    lock.unlock();
+    task(index);
+    lock.lock();
+    --remaining_;
+  }
+  done_.wait(lock, [this] { return remaining_ == 0; });
+  if (count_faults_)
+    ScopedFaults::AddDelegated(faults_);
+
+  task_ = nullptr;
+  count_ = 0;
+  next_ = 0;
+}
+
+void WorkerPool::Loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this] { return quit_ || next_ < count_; });
+    if (quit_)
+      return;
+
+    size_t index = next_++;
+    const auto* task = task_;
+    bool counted = count_faults_;
+    lock.unlock();
+    Faults before, after;
+    counted = counted && ReadThreadFaults(before);
+    (*task)(index);
+    counted = counted && ReadThreadFaults(after);
+    lock.lock();
+    if (counted) {
+      faults_.minor += after.minor - before.minor;
+      faults_.major += after.major - before.major;
+    }
+    if (--remaining_ == 0)
+      done_.notify_all();
+  }
+}
+
+}  // namespace graphics
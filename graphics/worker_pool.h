@@ -0,0 +1,54 @@
+#pragma once
+// Copyright (c) 2023-2024 Chase Colman. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_stats.h"
+
+namespace graphics {
+
+// A fixed set of threads that split up a batch of tasks with the caller
+class WorkerPool {
+ public:
+  // Shared by every buffer, sized to the available cores
+  static WorkerPool& Shared();
+
+  explicit WorkerPool(size_t threads);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Number of tasks that can run at once, including the calling thread
+  size_t concurrency() const { return threads_.size() + 1; }
+
+  // Runs |task| for every index in [0, count) and returns once all are done.
+  // Page faults the pool threads take are added to the caller's ScopedFaults
+  void Run(size_t count, const std::function<void(size_t)>& task);
+
+ private:
+  void Loop();
+
+  std::vector<std::thread> threads_;
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(size_t)>* task_ = nullptr;
+  size_t count_ = 0;
+  size_t next_ = 0;
+  size_t remaining_ = 0;
+  // Whether the pool threads measure their faults for the current caller
+  bool count_faults_ = false;
+  Faults faults_;
+  bool quit_ = false;
+};
+
+}  // namespace graphics
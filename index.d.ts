@@ -10,11 +10,300 @@ export type Rect = {
 	y: number;
 } & Size;
 
+/** layout of a BGRA frame within a buffer */
+export type SourceSize = Size & {
+	/** bytes from the start of one row to the next, defaults to width * 4 */
+	stride?: number;
+	/** bytes before the first row, defaults to 0 */
+	offset?: number;
+};
+
+export type ShmGraphicBufferOptions = {
+	/**
+	 * keeps the shared memory mapped between writes, growing it as needed
+	 * instead of opening and mapping it on every write
+	 */
+	persistent?: boolean;
+	/**
+	 * "rgb" packs pixels to 24 bits without alpha (f=24), which is a quarter
+	 * smaller than "rgba" (f=32), defaults to "rgba"
+	 */
+	format?: "rgba" | "rgb";
+	/**
+	 * sizes the shared memory for transparent huge pages where the kernel's
+	 * shmem settings allow them, and faults it in when it's created instead of
+	 * on the first write, best combined with persistent
+	 */
+	hugePages?: boolean;
+	/** times every phase of a write so that stats can be used */
+	stats?: boolean;
+	/** hashes the rows of every frame so that scroll can be used */
+	detectScroll?: boolean;
+};
+
+/** durations in microseconds, p99 is rounded up to within about 19% */
+export type PhaseStats = {
+	count: number;
+	min: number;
+	avg: number;
+	p99: number;
+	max: number;
+};
+
+export type ShmGraphicBufferStats = {
+	frames: number;
+	/** bytes written to the shared memory */
+	bytes: number;
+	/** times the shared memory had to be opened or mapped again */
+	remaps: number;
+	/** page faults taken while writing, on every thread the write ran on */
+	minorFaults: number;
+	majorFaults: number;
+	phases: {
+		/** shm_open */
+		open: PhaseStats;
+		/** ftruncate */
+		resize: PhaseStats;
+		/** mmap, including prefaulting */
+		map: PhaseStats;
+		/** copying the pixels, including row hashes */
+		swizzle: PhaseStats;
+		/** munmap */
+		unmap: PhaseStats;
+		/** the whole write */
+		frame: PhaseStats;
+	};
+};
+
+export type ScrollEstimate = {
+	/** rows the content moved by since the frame before, positive when down */
+	dy: number;
+	/** full width rows that were scrolled into view */
+	exposedRect: Rect;
+	/** other full width rows that don't match the moved content, such as sticky headers */
+	changedRects: Rect[];
+};
+
+export type WrittenRect = Rect & {
+	/** the kitty f= value of the pixels that were written */
+	format: 32 | 24;
+};
+
 export declare class ShmGraphicBuffer {
-	constructor(name: string);
-	write(buffer: Buffer, sourceSize: Size, destRect?: Rect): Rect;
+	constructor(name: string, options?: ShmGraphicBufferOptions);
+	/**
+	 * swizzles destRect of the frame into the shared memory, when targetSize is
+	 * smaller than sourceSize the frame is downscaled in the same pass and the
+	 * returned rect is in target pixels, halving is fastest and other ratios are
+	 * vectorized unless they shrink by more than about 32x
+	 */
+	write(
+		buffer: Buffer,
+		sourceSize: SourceSize,
+		destRect?: Rect,
+		targetSize?: Size,
+	): WrittenRect;
+	/**
+	 * writes every dirty rect in one pass, overlapping or adjacent rects are
+	 * merged and the regions that were actually written are returned
+	 */
+	write(
+		buffer: Buffer,
+		sourceSize: SourceSize,
+		destRects: Rect[],
+		targetSize?: Size,
+	): WrittenRect[];
+	/**
+	 * same as write, but the copy runs off the main thread, the buffer must not
+	 * be modified until the promise settles. calls on the same buffer are
+	 * queued and written in order, write throws while any are in flight
+	 */
+	writeAsync(
+		buffer: Buffer,
+		sourceSize: SourceSize,
+		destRect?: Rect,
+		targetSize?: Size,
+	): Promise<WrittenRect>;
+	writeAsync(
+		buffer: Buffer,
+		sourceSize: SourceSize,
+		destRects: Rect[],
+		targetSize?: Size,
+	): Promise<WrittenRect[]>;
+	/**
+	 * estimates how far the last written frame scrolled from the one before,
+	 * in target pixels, requires detectScroll
+	 */
+	scroll(): ScrollEstimate;
+	/**
+	 * counters since creation or resetStats as of the last write that
+	 * finished, requires stats
+	 */
+	stats(): ShmGraphicBufferStats;
+	resetStats(): void;
+	/** sizes the shared memory ahead of a write of sourceSize */
+	resize(sourceSize: Size): void;
+	/** whether the shared memory was backed by huge pages, not rechecked mid-write */
+	readonly hugePages: boolean;
+	/**
+	 * unmaps and unlinks the shared memory, the buffer can't be written to
+	 * afterwards. queued writeAsync calls are rejected and the one in flight
+	 * finishes before the shared memory is released
+	 */
+	close(): void;
+}
+
+export type RingRect = Rect & {
+	/** the slot that was written, to be passed to release */
+	slot: number;
+	/** the shared memory name to transmit to the terminal */
+	name: string;
+};
+
+/**
+ * A ring of shared memory buffers named `${name}-0` to `${name}-${count - 1}`,
+ * each write goes to the next slot that the terminal has released
+ */
+export declare class ShmGraphicBufferRing {
+	/** count defaults to 3 */
+	constructor(name: string, count?: number);
+	/** returns null when every slot is still waiting to be released */
+	write(
+		buffer: Buffer,
+		sourceSize: SourceSize,
+		destRect?: Rect,
+	): RingRect | null;
+	/** marks a slot as read by the terminal so that it can be written again */
+	release(slot: number): void;
+	/** unmaps and unlinks every slot */
+	close(): void;
+}
+
+export type ShmTileCacheOptions = {
+	/** width and height of the tiles, defaults to 64 */
+	tileSize?: number;
+	/** ids that are kept before the least recently used are reused, defaults to 1024 */
+	capacity?: number;
+	/** the first kitty image id handed out, defaults to 1 */
+	firstId?: number;
+};
+
+export type Tile = Rect & {
+	/** the kitty image id that holds the tile */
+	id: number;
+	/**
+	 * the tile has to be transmitted to id before it's placed, and stays fresh
+	 * until the transmission is confirmed. only the first of identical tiles
+	 * in a write is fresh, the rest place its id
+	 */
+	fresh: boolean;
+	/** the shared memory that holds only this fresh tile's RGBA pixels (t=s) */
+	name?: string;
+	/** bytes of the tile's pixels (S=) */
+	size: number;
+};
+
+export type TileWrite = {
+	tiles: Tile[];
+};
+
+/**
+ * splits frames into tiles that are each their own kitty image, tiles with
+ * contents that were already transmitted can be placed again by id
+ */
+export declare class ShmTileCache {
+	constructor(name: string, options?: ShmTileCacheOptions);
+	/** writes and looks up every tile that overlaps destRect */
+	write(buffer: Buffer, sourceSize: SourceSize, destRect?: Rect): TileWrite;
+	/**
+	 * records whether the fresh tiles of ids were transmitted, only then is
+	 * their content placed by id; ids that are never confirmed aren't reused
+	 */
+	confirm(ids: number[], transmitted?: boolean): void;
+	/** forgets every id, for when the terminal's images were deleted */
+	clear(): void;
+	/** unlinks the shared memory of tiles that weren't confirmed */
+	close(): void;
+}
+
+export type FrameDiffOptions = {
+	/** width and height of the tiles that are compared, defaults to 64 */
+	tileSize?: number;
+};
+
+/** keeps the previous frame to find which tiles of the next frame changed */
+export declare class FrameDiff {
+	constructor(options?: FrameDiffOptions);
+	/**
+	 * compares destRect of the frame against the previous frame and returns the
+	 * changed tiles merged into rects, ready to be passed to write
+	 */
+	diff(buffer: Buffer, sourceSize: Size, destRect?: Rect): Rect[];
+	/** forgets the previous frame, so that the next frame is entirely dirty */
+	reset(): void;
+}
+
+export type KittyGraphicsEncoderOptions = {
+	/** compresses the pixels with zlib (o=z), defaults to false */
+	compress?: boolean;
+	/**
+	 * milliseconds available for each frame, the compression level is adjusted
+	 * to stay within it, defaults to 1000/60
+	 */
+	frameBudget?: number;
+};
+
+/** encodes frames as kitty graphics escapes for direct transmission (t=d) */
+export declare class KittyGraphicsEncoder {
+	constructor(options?: KittyGraphicsEncoderOptions);
+	/**
+	 * encodes destRect of the frame as RGBA, chunked into as many escapes as
+	 * needed, control holds the keys for the first escape (e.g. "a=T,i=1,q=2")
+	 * @returns the escapes, which are overwritten by the next call to encode
+	 */
+	encode(
+		buffer: Buffer,
+		sourceSize: Size,
+		destRect?: Rect,
+		control?: string,
+	): Uint8Array;
+	/**
+	 * same as encode, but compresses and encodes off the main thread. calls
+	 * made before the promise settles write to their own buffer, the escapes
+	 * are overwritten by the first call after it settles
+	 */
+	encodeAsync(
+		buffer: Buffer,
+		sourceSize: Size,
+		destRect?: Rect,
+		control?: string,
+	): Promise<Uint8Array>;
+	/** zlib level for the next frame, 0 when not compressing */
+	readonly compressionLevel: number;
 }
 
+export type CpuFeatures = {
+	/** instruction set of the pixel kernels in use */
+	kernel: "scalar" | "ssse3" | "avx2" | "avx512bw" | "neon";
+	ssse3: boolean;
+	avx2: boolean;
+	avx512bw: boolean;
+	neon: boolean;
+};
+
+/**
+ * reports what the CPU supports and which pixel kernels were selected, the
+ * AWRIT_NATIVE_ISA environment variable caps the selection (e.g. "avx2")
+ */
+export declare function getCpuFeatures(): CpuFeatures;
+
+/**
+ * regions of at least this many bytes are written to shared memory with
+ * non-temporal stores that bypass the cache, 0 turns them off, defaults to
+ * 4 MiB. returns the previous threshold, bytes can be left out to only read it
+ */
+export declare function setStreamingThreshold(bytes?: number): number;
+
 /** sets termios attributes to allow realtime updates for key input */
 export declare function setupInput(): void;
 /** restores termios attributes to the original attributes before calling setupTermios */
@@ -44,6 +333,7 @@ export declare enum EscapeType {
 	APC = 6,
 	Key = 7,
 	Mouse = 8,
+	Paste = 10,
 }
 
 export declare enum MouseModifier {
@@ -69,7 +359,7 @@ export declare enum MouseButton {
 	None = 0,
 }
 
-export type InputEvent =
+export type InputEvent = (
 	| {
 			type: EscapeType.Key;
 			event: KeyEvent;
@@ -91,6 +381,7 @@ export type InputEvent =
 				| "capsLock"
 				| "numLock"
 			>;
+			/** the character of KeyEvent.Unicode, or a run of text with mergeText */
 			code: string;
 	  }
 	| {
@@ -110,15 +401,158 @@ export type InputEvent =
 				| EscapeType.SOS
 				| EscapeType.APC;
 			data: string;
-	  };
+	  }
+	| {
+			type: EscapeType.Paste;
+			/**
+			 * the text between the bracketed paste markers, pastes of more than
+			 * 256 KiB arrive in chunks
+			 */
+			data: string;
+			/** more of the same paste follows */
+			partial: boolean;
+	  }
+) & {
+	/** events merged into this one, only set when coalescing */
+	coalescedCount?: number;
+};
+
+export type ListenForInputOptions = {
+	/** @deprecated ignored, input is delivered as soon as it arrives */
+	interval?: number;
+	/**
+	 * calls back once per read of the terminal with every event parsed from
+	 * it, instead of once per event
+	 */
+	batch?: boolean;
+	/**
+	 * merges neighbouring mouse moves with the same buttons and modifiers into
+	 * the latest one, and repeats of the same key into one, adding
+	 * coalescedCount to every event
+	 */
+	coalesce?: boolean;
+	/**
+	 * text that arrives at once is one KeyEvent.Unicode event with all of its
+	 * characters instead of one event per character, ignored with a ring
+	 */
+	mergeText?: boolean;
+	/**
+	 * milliseconds that a move or repeat is held back for more of the same,
+	 * defaults to 0, which only merges events from the same read
+	 */
+	coalesceLatency?: number;
+	/**
+	 * events that are held for the callback before reading the terminal stops
+	 * until it catches up, defaults to 1024
+	 */
+	queueSize?: number;
+	/**
+	 * called once listening stops on its own, at the end of stdin or on a read
+	 * error, after the events read before it
+	 */
+	onEnd?: () => void;
+};
+
+export type InputListenerOptions = ListenForInputOptions & {
+	/** writes key and mouse events to a ring of this many records, see listenForInputRing */
+	ring?: number;
+};
 
 /**
- * Listens for input events at intervalMs, defaults to 10ms
+ * reads input on its own thread while started, the callback gets the same
+ * arguments as listenForInput's, or listenForInputRing's with ring
+ */
+export declare class InputListener {
+	constructor(
+		cb: (evt: InputEvent) => void,
+		options?: InputListenerOptions & { batch?: false },
+	);
+	constructor(
+		cb: (evts: InputEvent[]) => void,
+		options: InputListenerOptions & ({ batch: true } | { ring: number }),
+	);
+	/** starts reading input, or resumes after pause or stop */
+	start(): void;
+	/** stops reading input, events already read are delivered after start */
+	pause(): void;
+	/** stops reading input and drops the events that weren't delivered yet */
+	stop(): void;
+	/** stops and releases the callback, the listener can't be started again */
+	close(): void;
+	/** false again once stopped, including on its own (see onEnd) */
+	readonly listening: boolean;
+	/** the buffer of the records, with the ring option */
+	readonly ring: ArrayBuffer | undefined;
+	/**
+	 * tells the listener that records were read outside of the callback, so
+	 * that it stops waiting for room in a full ring
+	 */
+	consumed(): void;
+}
+
+/**
+ * Listens for input events, which are read as soon as they arrive
  * @param cb the callback to be called when an event occurs
- * @param intervalMs defaults to 10ms
+ * @param intervalMs ignored, kept for compatibility
  * @returns Cancel callback
  */
 export declare function listenForInput(
 	cb: (evt: InputEvent) => void,
 	intervalMs?: number,
 ): () => void;
+export declare function listenForInput(
+	cb: (evt: InputEvent) => void,
+	options?: ListenForInputOptions & { batch?: false },
+): () => void;
+export declare function listenForInput(
+	cb: (evts: InputEvent[]) => void,
+	options: ListenForInputOptions & { batch: true },
+): () => void;
+
+export type ListenForInputRingOptions = Omit<ListenForInputOptions, "batch"> & {
+	/** records that fit in the ring, rounded up to a power of two, defaults to 1024 */
+	capacity?: number;
+};
+
+export declare const InputRing: {
+	readonly HeaderWords: 8;
+	readonly RecordWords: 8;
+	/** records written by the listener, as a wrapping count */
+	readonly Write: 0;
+	/** records read by JS, as a wrapping count */
+	readonly Read: 1;
+	readonly Capacity: 2;
+	/** EscapeType.Key or EscapeType.Mouse */
+	readonly Type: 0;
+	/** KeyEvent or MouseEvent, repeats are kept as KeyEvent.Repeat */
+	readonly Event: 1;
+	/** kitty modifier bits for keys (shift 1, alt 2, ctrl 4, super 8), MouseModifier for the mouse */
+	readonly Modifiers: 2;
+	/** the codepoint or kitty functional key number (from 57344) of keys, MouseButton for the mouse */
+	readonly Key: 3;
+	readonly X: 4;
+	readonly Y: 5;
+	/** events merged into this one, when coalescing */
+	readonly Coalesced: 6;
+};
+
+/**
+ * same as listenForInput, but key and mouse events are written as records to
+ * a ring in buffer, which are read with readInputRing on an Int32Array over
+ * it. cb is called when there are new records, with the events that have no
+ * record, which aren't ordered relative to the records. buffer is only
+ * written on the main thread right before cb, so it's read without Atomics;
+ * transferring it stops the records. when the ring is full, reading the
+ * terminal waits until cb returns, or until consumed is called after reading
+ * elsewhere
+ */
+export declare function listenForInputRing(
+	cb: (evts: InputEvent[]) => void,
+	options?: ListenForInputRingOptions,
+): { buffer: ArrayBuffer; cancel: () => void; consumed: () => void };
+
+/** calls back with the offset in words of every unread record, then marks them read */
+export declare function readInputRing(
+	words: Int32Array,
+	callback: (offset: number) => void,
+): void;
@@ -42,4 +42,36 @@ module.exports.EscapeType = {
   APC: 6,
   Key: 7,
   Mouse: 8,
+  Paste: 10,
+};
+// Layout of the buffer of listenForInputRing, in 32-bit words
+module.exports.InputRing = {
+  HeaderWords: 8,
+  RecordWords: 8,
+  // Header
+  Write: 0,
+  Read: 1,
+  Capacity: 2,
+  // Record
+  Type: 0,
+  Event: 1,
+  Modifiers: 2,
+  Key: 3,
+  X: 4,
+  Y: 5,
+  Coalesced: 6,
+};
+// Calls back with the word offset of every record that hasn't been read yet,
+// then marks them as read, words is an Int32Array over the whole buffer. The
+// buffer is only written on the main thread, so plain reads are enough.
+module.exports.readInputRing = (words, callback) => {
+  const { HeaderWords, RecordWords, Write, Read, Capacity } =
+    module.exports.InputRing;
+  const mask = words[Capacity] - 1;
+  const write = words[Write];
+  let read = words[Read];
+  for (; read !== write; read = (read + 1) | 0) {
+    callback(HeaderWords + (read & mask) * RecordWords);
+  }
+  words[Read] = read;
 };
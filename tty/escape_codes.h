@@ -17,3 +17,6 @@
 #define DECSACE_DEFAULT_REGION_SELECT CSI "*x"
 #define CLEAR_SCREEN CSI "H" CSI "2J"
 #define RESET_IRM CSI "4l"
+#define APC ESC "_"
+#define ST ESC "\\"
+#define KITTY_GRAPHICS APC "G"
@@ -4,9 +4,133 @@
 
 #include "escape_parser.h"
 
+#include <cstring>
+
+#include "graphics/cpu_features.h"
+
+#if defined(AWRIT_X86)
+#include <immintrin.h>
+#elif defined(AWRIT_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace tty {
 
 namespace {
+
+constexpr std::string_view kPasteStart = "200~";
+constexpr std::string_view kPasteEnd = "\x1b[201~";
+
+// Returns the length of the printable ASCII prefix of |data|, stopping at
+// controls (including ESC), DEL and every byte of multibyte UTF-8
+using PrintableFn = size_t (*)(const char* data, size_t size);
+
+size_t printable_scalar(const char* data, size_t size) {
+  size_t i = 0;
+  for (; i < size; ++i) {
+    auto ch = static_cast<uint8_t>(data[i]);
+    if (ch < 0x20 || ch >= 0x7f)
+      break;
+  }
+  return i;
+}
+
+#if defined(AWRIT_X86)
+// SSE2 is part of the x86-64 baseline, it's used for the SSSE3 tier
+size_t printable_sse2(const char* data, size_t size) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+    // Signed, so bytes from 0x80 up are below space as well
+    __m128i stop = _mm_or_si128(_mm_cmplt_epi8(bytes, space),
+                                _mm_cmpeq_epi8(bytes, del));
+    if (int mask = _mm_movemask_epi8(stop))
+      return i + __builtin_ctz(mask);
+  }
+  return i + printable_scalar(data + i, size - i);
+}
+
+AWRIT_TARGET("avx2")
+size_t printable_avx2(const char* data, size_t size) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi8(space, bytes),
+                                   _mm256_cmpeq_epi8(bytes, del));
+    if (uint32_t mask = _mm256_movemask_epi8(stop))
+      return i + __builtin_ctz(mask);
+  }
+  return i + printable_sse2(data + i, size - i);
+}
+#elif defined(AWRIT_NEON)
+size_t printable_neon(const char* data, size_t size) {
+  const uint8x16_t space = vdupq_n_u8(0x20);
+  const uint8x16_t del = vdupq_n_u8(0x7f);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t bytes = vld1q_u8((const uint8_t*)(data + i));
+    uint8x16_t stop = vorrq_u8(vcltq_u8(bytes, space), vcgeq_u8(bytes, del));
+    if (vmaxvq_u8(stop) != 0)
+      break;
+  }
+  return i + printable_scalar(data + i, size - i);
+}
+#endif
+
+PrintableFn select_printable() {
+  using graphics::Isa;
+  switch (graphics::ActiveIsa()) {
+#if defined(AWRIT_X86)
+    case Isa::AVX512BW:
+    case Isa::AVX2:
+      return printable_avx2;
+    case Isa::SSSE3:
+      return printable_sse2;
+#elif defined(AWRIT_NEON)
+    case Isa::NEON:
+      return printable_neon;
+#endif
+    default:
+      return printable_scalar;
+  }
+}
+
+// Returns the length of the UTF-8 sequence at the start of |data| when it's
+// complete, valid and not a C1 control, otherwise 0
+size_t text_sequence(const char* data, size_t size) {
+  utf8::State state = utf8::kAccept;
+  uint32_t codepoint = 0;
+  for (size_t i = 0; i < size && i < 4; ++i) {
+    switch (utf8::decode(&state, &codepoint, data[i])) {
+      case utf8::kAccept:
+        return codepoint >= 0xa0 ? i + 1 : 0;
+      case utf8::kReject:
+        return 0;
+    }
+  }
+  return 0;
+}
+
+// Returns the length of the text at the start of |data| that can be handed
+// on as is, which is printable ASCII and UTF-8 other than C1 controls
+size_t text_length(const char* data, size_t size) {
+  static const PrintableFn printable = select_printable();
+  size_t i = 0;
+  while (i < size) {
+    i += printable(data + i, size - i);
+    if (i == size || static_cast<uint8_t>(data[i]) < 0x80)
+      break;
+    size_t length = text_sequence(data + i, size - i);
+    if (length == 0)
+      break;
+    i += length;
+  }
+  return i;
+}
 csi::Char csi_type(char ch) {
   if ((0x30 <= ch && ch <= 0x3f) || ch == '-') {
     return csi::Char::Parameter;
@@ -37,6 +161,8 @@ bool EscapeCodeParser::Reset() {
   utf8_codepoint_ = 0;
   handler_ = Type::None;
   csi_state_ = csi::State::Parameter;
+  paste_.clear();
+  paste_end_ = 0;
 
   return false;
 }
@@ -68,21 +194,52 @@ bool EscapeCodeParser::Parse(char ch) {
     case State::C1_ST:
       if (!Byte(ch))
         return false;
+      break;
+
+    case State::Paste:
+      ParsePaste({&ch, 1});
+      break;
   }
 
   return true;
 }
 
 bool EscapeCodeParser::Parse(std::string_view buffer) {
-  if (buffer.empty())
-    return true;
-  for (char ch : buffer) {
-    if (!Parse(ch))
+  size_t i = 0;
+  while (i < buffer.size()) {
+    if (state_ == State::Paste) {
+      i += ParsePaste(buffer.substr(i));
+      continue;
+    }
+    // Runs of text between escape codes skip the decoder
+    if (state_ == State::Normal && utf8_state_ == utf8::kAccept) {
+      size_t length = text_length(buffer.data() + i, buffer.size() - i);
+      if (length > 0) {
+        HandleText(buffer.substr(i, length));
+        i += length;
+        continue;
+      }
+    }
+    if (!Parse(buffer[i++]))
       return false;
   }
   return true;
 }
 
+bool EscapeCodeParser::HandlePaste(std::string_view text, bool) {
+  return EscapeCodeParser::HandleText(text);
+}
+
+bool EscapeCodeParser::HandleText(std::string_view text) {
+  utf8::State state = utf8::kAccept;
+  uint32_t codepoint = 0;
+  for (char ch : text) {
+    if (utf8::decode(&state, &codepoint, ch) == utf8::kAccept)
+      HandleUTF8Codepoint(codepoint);
+  }
+  return true;
+}
+
 bool EscapeCodeParser::UTF8Codepoint(uint32_t ch) {
   switch (ch) {
     case 0x1b:
@@ -137,6 +294,7 @@ bool EscapeCodeParser::Byte(uint8_t ch) {
     case State::C1_ST:
       return C1_ST(ch);
     case State::Normal:
+    case State::Paste:
       return true;
     default:
       unreachable();
@@ -247,6 +405,11 @@ bool EscapeCodeParser::C1_ST(uint8_t ch) {
 
 bool EscapeCodeParser::EscapeCode() {
   bool result = true;
+  if (handler_ == Type::CSI && buffer_ == kPasteStart) {
+    Reset();
+    state_ = State::Paste;
+    return result;
+  }
   if (handler_ != Type::None) {
     Handle(handler_, buffer_);
   }
@@ -254,4 +417,60 @@ bool EscapeCodeParser::EscapeCode() {
   return result;
 }
 
+// Copies pasted text up to the end marker without looking at each byte,
+// returning how much of |buffer| was part of the paste
+size_t EscapeCodeParser::ParsePaste(std::string_view buffer) {
+  size_t i = 0;
+  while (i < buffer.size()) {
+    if (paste_end_ > 0) {
+      if (buffer[i] == kPasteEnd[paste_end_]) {
+        ++i;
+        if (++paste_end_ == kPasteEnd.size()) {
+          FlushPaste(true);
+          Reset();
+          return i;
+        }
+        continue;
+      }
+      // It was pasted text after all, the byte is looked at again
+      paste_.append(kPasteEnd.substr(0, paste_end_));
+      paste_end_ = 0;
+      continue;
+    }
+
+    const char* start = buffer.data() + i;
+    const auto* esc =
+        static_cast<const char*>(std::memchr(start, 0x1b, buffer.size() - i));
+    size_t length = esc == nullptr ? buffer.size() - i : esc - start;
+    paste_.append(start, length);
+    i += length;
+    if (esc != nullptr) {
+      paste_end_ = 1;
+      ++i;
+    }
+    FlushPaste(false);
+  }
+  return i;
+}
+
+// Hands on whole chunks of the paste, or all of it when it's the |last|
+void EscapeCodeParser::FlushPaste(bool last) {
+  size_t start = 0;
+  while (paste_.size() - start >= kPasteChunkSize) {
+    size_t end = start + kPasteChunkSize;
+    // Backs up to the start of a UTF-8 sequence
+    while (end > start + 1 &&
+           (static_cast<uint8_t>(paste_[end]) & 0xc0) == 0x80)
+      --end;
+    HandlePaste(std::string_view(paste_).substr(start, end - start), false);
+    start = end;
+  }
+  if (last) {
+    HandlePaste(std::string_view(paste_).substr(start), true);
+    paste_.clear();
+  } else if (start > 0) {
+    paste_.erase(0, start);
+  }
+}
+
 }  // namespace tty
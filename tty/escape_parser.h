@@ -23,6 +23,8 @@ class EscapeCodeParser {
   EscapeCodeParser() { Reset(); }
 
   bool Parse(std::string_view buffer);
+  // Drops any partial escape code or UTF-8 sequence
+  bool Reset();
 
   enum class Type : int {
     None = 0,
@@ -35,10 +37,22 @@ class EscapeCodeParser {
     Key = 7,
     Mouse = 8,
     Unicode = 9,
+    Paste = 10,
   };
 
+  // Bracketed pastes longer than this are handed on in chunks of about this
+  // size, split between UTF-8 sequences
+  static constexpr size_t kPasteChunkSize = 256 * 1024;
+
  protected:
   virtual bool HandleUTF8Codepoint(uint32_t) { return true; };
+  // Printable ASCII and UTF-8 text without controls, as found between escape
+  // codes. Calls HandleUTF8Codepoint for every codepoint unless overridden.
+  virtual bool HandleText(std::string_view text);
+  // Text between the bracketed paste markers, |last| is false while more of
+  // the same paste follows. Calls HandleUTF8Codepoint for every codepoint
+  // unless overridden.
+  virtual bool HandlePaste(std::string_view text, bool last);
   virtual bool Handle(Type type, const std::string&) { return true; };
 
  private:
@@ -50,6 +64,7 @@ class EscapeCodeParser {
     ST_or_BEL,
     ESC_ST,
     C1_ST,
+    Paste,
   };
 
   State state_;
@@ -58,14 +73,18 @@ class EscapeCodeParser {
   csi::State csi_state_;
   std::string buffer_;
   Type handler_;
+  // The paste so far, and how much of the end marker has been seen
+  std::string paste_;
+  size_t paste_end_;
 
   bool Parse(char ch);
-  bool Reset();
 
   bool Byte(uint8_t ch);
   bool UTF8Codepoint(uint32_t ch);
   void Invalid() { Reset(); };
   bool EscapeCode();
+  size_t ParsePaste(std::string_view buffer);
+  void FlushPaste(bool last);
 
   bool ESC(uint8_t ch);
   bool CSI(uint8_t ch);
@@ -3,11 +3,46 @@
 // Use of this source code is governed by a BSD-style license that can be found
 // in the LICENSE file.
 
-#include <string>
+#include <cstddef>
+#include <optional>
+#include <string_view>
 
 namespace tty::in {
 void Setup();
-bool WaitForReady(int timeout_ms = 20);
-std::string Read();
+// Bytes that are read at a time
+constexpr size_t kReadSize = 4096;
+// Reads up to |size| bytes of stdin into |buffer|, returning what was read,
+// which is empty when nothing was available, or nullopt once it reached end
+// of file or failed
+std::optional<std::string_view> Read(char* buffer, size_t size = kReadSize);
 void Cleanup();
+
+// Blocks until stdin is readable without polling, using epoll on Linux and
+// poll elsewhere, and can be woken from another thread to stop waiting
+class Waiter {
+ public:
+  enum class Result { Ready, Timeout, Woken, Closed };
+
+  Waiter();
+  ~Waiter();
+  Waiter(const Waiter&) = delete;
+  Waiter& operator=(const Waiter&) = delete;
+
+  // Waits for up to |timeout_ms|, or until woken when it's negative. Closed
+  // is returned once stdin hung up or can't be waited on.
+  // Regular files and /dev/null are always Ready, end of file is only found
+  // by reading.
+  Result Wait(int timeout_ms = -1);
+  // Makes the current and every later Wait return Woken until Reset, from
+  // any thread
+  void Wake();
+  void Reset();
+
+ private:
+  // An eventfd on Linux, the read end of a pipe elsewhere
+  int wake_fd_ = -1;
+  int wake_write_fd_ = -1;
+  // -1 when epoll isn't available or stdin can't be added to it
+  int epoll_fd_ = -1;
+};
 }  // namespace tty::in
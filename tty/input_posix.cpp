@@ -2,11 +2,18 @@
 // Use of this source code is governed by a BSD-style license that can be found
 // in the LICENSE file.
 
-#include <sys/select.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 
-#include <array>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
 
 #include "input.h"
 
@@ -40,31 +47,113 @@ void Cleanup() {
   tcsetattr(STDIN_FILENO, TCSANOW, get_terminal());
 }
 
-bool WaitForReady(int timeout_ms) {
-  const int kTimeout_us = timeout_ms * 1000;
+Waiter::Waiter() {
+#ifdef __linux__
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  wake_write_fd_ = wake_fd_;
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ >= 0) {
+    epoll_event stdin_event{};
+    stdin_event.events = EPOLLIN;
+    stdin_event.data.fd = STDIN_FILENO;
+    epoll_event wake_event{};
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = wake_fd_;
+    // Regular files can't be added to epoll, poll handles those
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, STDIN_FILENO, &stdin_event) != 0 ||
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &wake_event) != 0) {
+      close(epoll_fd_);
+      epoll_fd_ = -1;
+    }
+  }
+#else
+  int fds[2];
+  if (pipe(fds) == 0) {
+    for (int fd : fds) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    wake_fd_ = fds[0];
+    wake_write_fd_ = fds[1];
+  }
+#endif
+}
 
-  static timeval tv = {0, kTimeout_us};
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(STDIN_FILENO, &fds);
-  select(STDIN_FILENO + 1, &fds, nullptr, nullptr, &tv);
-  return FD_ISSET(STDIN_FILENO, &fds);
+Waiter::~Waiter() {
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+  if (wake_write_fd_ >= 0 && wake_write_fd_ != wake_fd_)
+    close(wake_write_fd_);
+  if (wake_fd_ >= 0)
+    close(wake_fd_);
 }
 
-std::string Read() {
-  static constexpr size_t kBufferSize = 4096;
-  static std::array<char, kBufferSize> buffer;
-  size_t actual_size = read(STDIN_FILENO, buffer.data(), kBufferSize);
+Waiter::Result Waiter::Wait(int timeout_ms) {
+  if (wake_fd_ < 0)
+    return Result::Closed;
 
-#ifdef __APPLE__
-  // for some weird reason, it passes -1 for a size_t now, thanks Cupertino
-  if (actual_size == (size_t)-1)
-    return {};
+  bool woken = false;
+  bool ready = false;
+  bool hung_up = false;
+#ifdef __linux__
+  if (epoll_fd_ >= 0) {
+    epoll_event events[2];
+    int count = epoll_wait(epoll_fd_, events, 2, timeout_ms);
+    if (count < 0)
+      return errno == EINTR ? Result::Timeout : Result::Closed;
+    for (int i = 0; i < count; ++i) {
+      if (events[i].data.fd == wake_fd_) {
+        woken = true;
+      } else {
+        ready = events[i].events & EPOLLIN;
+        hung_up = events[i].events & (EPOLLHUP | EPOLLERR);
+      }
+    }
+  } else
 #endif
-  if (actual_size == 0 || actual_size > kBufferSize)
-    return {};
+  {
+    pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+    int count = poll(fds, 2, timeout_ms);
+    if (count < 0)
+      return errno == EINTR ? Result::Timeout : Result::Closed;
+    woken = fds[1].revents & POLLIN;
+    ready = fds[0].revents & POLLIN;
+    hung_up = fds[0].revents & (POLLHUP | POLLERR | POLLNVAL);
+  }
+
+  if (woken)
+    return Result::Woken;
+  // Whatever was written before the hang up is still read, the read after it
+  // finds the end of file
+  if (ready)
+    return Result::Ready;
+  return hung_up ? Result::Closed : Result::Timeout;
+}
+
+void Waiter::Wake() {
+  // Stays readable until Reset, so a wake before Wait isn't lost
+  const uint64_t one = 1;
+  [[maybe_unused]] ssize_t written = write(wake_write_fd_, &one, sizeof(one));
+}
+
+void Waiter::Reset() {
+  uint64_t drain;
+  while (read(wake_fd_, &drain, sizeof(drain)) > 0) {
+  }
+}
+
+std::optional<std::string_view> Read(char* buffer, size_t size) {
+  ssize_t actual_size = read(STDIN_FILENO, buffer, size);
+
+  if (actual_size < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+      return std::string_view();
+    return std::nullopt;
+  }
+  if (actual_size == 0)
+    return std::nullopt;
 
-  return {buffer.data(), actual_size};
+  return std::string_view(buffer, actual_size);
 }
 
 }  // namespace tty::in
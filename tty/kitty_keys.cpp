@@ -4,13 +4,12 @@
 
 #include "kitty_keys.h"
 
+#include <array>
 #include <charconv>
 #include <cstdio>
-#include <unordered_map>
-#include <vector>
+#include <utility>
 
 #include "escape_codes.h"
-#include "string/string_utils.h"
 
 namespace tty::keys {
 
@@ -29,264 +28,295 @@ void Disable() {
 
 namespace {
 
-std::u16string_view functional_key_number_to_electron_string(
-    uint16_t key_number) {
-  static const std::unordered_map<uint16_t, std::u16string_view> map{
-      {57344, u"esc"},
-      {57345, u"enter"},
-      {57346, u"tab"},
-      {57347, u"backspace"},
-      {57348, u"insert"},
-      {57349, u"delete"},
-      {57350, u"left"},
-      {57351, u"right"},
-      {57352, u"up"},
-      {57353, u"down"},
-      {57354, u"pageup"},
-      {57355, u"pagedown"},
-      {57356, u"home"},
-      {57357, u"end"},
-      {57358, u"capslock"},
-      {57359, u"scrolllock"},
-      {57360, u"numlock"},
-      {57361, u"printscreen"},
-      {57362, u"pause"},
-      {57363, u"menu"},
-      {57364, u"f1"},
-      {57365, u"f2"},
-      {57366, u"f3"},
-      {57367, u"f4"},
-      {57368, u"f5"},
-      {57369, u"f6"},
-      {57370, u"f7"},
-      {57371, u"f8"},
-      {57372, u"f9"},
-      {57373, u"f10"},
-      {57374, u"f11"},
-      {57375, u"f12"},
-      {57376, u"f13"},
-      {57377, u"f14"},
-      {57378, u"f15"},
-      {57379, u"f16"},
-      {57380, u"f17"},
-      {57381, u"f18"},
-      {57382, u"f19"},
-      {57383, u"f20"},
-      {57384, u"f21"},
-      {57385, u"f22"},
-      {57386, u"f23"},
-      {57387, u"f24"},
-      {57399, u"num0"},
-      {57400, u"num1"},
-      {57401, u"num2"},
-      {57402, u"num3"},
-      {57403, u"num4"},
-      {57404, u"num5"},
-      {57405, u"num6"},
-      {57406, u"num7"},
-      {57407, u"num8"},
-      {57408, u"num9"},
-      {57409, u"numdec"},
-      {57410, u"numdiv"},
-      {57411, u"nummult"},
-      {57412, u"numsub"},
-      {57413, u"numadd"},
-      {57414, u"return"},
-      {57416, u"."},
-      {57417, u"left"},
-      {57418, u"right"},
-      {57419, u"up"},
-      {57420, u"down"},
-      {57421, u"pageup"},
-      {57422, u"pagedown"},
-      {57423, u"home"},
-      {57424, u"end"},
-      {57425, u"insert"},
-      {57426, u"delete"},
-      {57428, u"mediaplaypause"},
-      {57429, u"mediaplaypause"},
-      {57430, u"mediaplaypause"},
-      {57432, u"mediastop"},
-      {57435, u"medianexttrack"},
-      {57436, u"mediaprevtrack"},
-      {57438, u"volumedown"},
-      {57439, u"volumeup"},
-      {57440, u"volumemute"},
-      {57441, u"shift"},
-      {57442, u"control"},
-      {57443, u"alt"},
-      {57444, u"meta"},
-      {57445, u"meta"},
-      {57446, u"meta"},
-      {57447, u"shift"},
-      {57448, u"control"},
-      {57449, u"alt"},
-      {57450, u"meta"},
-      {57451, u"meta"},
-      {57452, u"meta"},
-  };
-  auto result = map.find(key_number);
-  return result == map.end() ? u"" : result->second;
-}
+struct FunctionalName {
+  uint32_t key;
+  std::u16string_view name;
+};
+
+constexpr FunctionalName kFunctionalNames[] = {
+    {57344, u"esc"},
+    {57345, u"enter"},
+    {57346, u"tab"},
+    {57347, u"backspace"},
+    {57348, u"insert"},
+    {57349, u"delete"},
+    {57350, u"left"},
+    {57351, u"right"},
+    {57352, u"up"},
+    {57353, u"down"},
+    {57354, u"pageup"},
+    {57355, u"pagedown"},
+    {57356, u"home"},
+    {57357, u"end"},
+    {57358, u"capslock"},
+    {57359, u"scrolllock"},
+    {57360, u"numlock"},
+    {57361, u"printscreen"},
+    {57362, u"pause"},
+    {57363, u"menu"},
+    {57364, u"f1"},
+    {57365, u"f2"},
+    {57366, u"f3"},
+    {57367, u"f4"},
+    {57368, u"f5"},
+    {57369, u"f6"},
+    {57370, u"f7"},
+    {57371, u"f8"},
+    {57372, u"f9"},
+    {57373, u"f10"},
+    {57374, u"f11"},
+    {57375, u"f12"},
+    {57376, u"f13"},
+    {57377, u"f14"},
+    {57378, u"f15"},
+    {57379, u"f16"},
+    {57380, u"f17"},
+    {57381, u"f18"},
+    {57382, u"f19"},
+    {57383, u"f20"},
+    {57384, u"f21"},
+    {57385, u"f22"},
+    {57386, u"f23"},
+    {57387, u"f24"},
+    {57399, u"num0"},
+    {57400, u"num1"},
+    {57401, u"num2"},
+    {57402, u"num3"},
+    {57403, u"num4"},
+    {57404, u"num5"},
+    {57405, u"num6"},
+    {57406, u"num7"},
+    {57407, u"num8"},
+    {57408, u"num9"},
+    {57409, u"numdec"},
+    {57410, u"numdiv"},
+    {57411, u"nummult"},
+    {57412, u"numsub"},
+    {57413, u"numadd"},
+    {57414, u"return"},
+    {57416, u"."},
+    {57417, u"left"},
+    {57418, u"right"},
+    {57419, u"up"},
+    {57420, u"down"},
+    {57421, u"pageup"},
+    {57422, u"pagedown"},
+    {57423, u"home"},
+    {57424, u"end"},
+    {57425, u"insert"},
+    {57426, u"delete"},
+    {57428, u"mediaplaypause"},
+    {57429, u"mediaplaypause"},
+    {57430, u"mediaplaypause"},
+    {57432, u"mediastop"},
+    {57435, u"medianexttrack"},
+    {57436, u"mediaprevtrack"},
+    {57438, u"volumedown"},
+    {57439, u"volumeup"},
+    {57440, u"volumemute"},
+    {57441, u"shift"},
+    {57442, u"control"},
+    {57443, u"alt"},
+    {57444, u"meta"},
+    {57445, u"meta"},
+    {57446, u"meta"},
+    {57447, u"shift"},
+    {57448, u"control"},
+    {57449, u"alt"},
+    {57450, u"meta"},
+    {57451, u"meta"},
+    {57452, u"meta"},
+};
+
+// Electron's names of the functional keys, indexed from kFirstFunctionalKey
+constexpr auto kFunctionalTable = [] {
+  std::array<std::u16string_view, kLastFunctionalKey - kFirstFunctionalKey + 1>
+      table{};
+  for (const FunctionalName& entry : kFunctionalNames)
+    table[entry.key - kFirstFunctionalKey] = entry.name;
+  return table;
+}();
 
-std::optional<uint16_t> csi_number_to_functional_number(uint16_t csi) {
-  static const std::unordered_map<uint16_t, uint16_t> map{
+// Functional key numbers of the legacy CSI numbers, 0 for the rest
+constexpr auto kLegacyTable = [] {
+  constexpr std::pair<uint8_t, uint16_t> legacy[] = {
       {2, 57348},   {3, 57349},  {5, 57354},  {6, 57355},  {7, 57356},
       {8, 57357},   {9, 57346},  {11, 57364}, {12, 57365}, {13, 57345},
       {14, 57367},  {15, 57368}, {17, 57369}, {18, 57370}, {19, 57371},
       {20, 57372},  {21, 57373}, {23, 57374}, {24, 57375}, {27, 57344},
       {127, 57347},
   };
-  auto result = map.find(csi);
-  if (result == map.end())
-    return {};
-
-  return result->second;
-}
+  std::array<uint16_t, 128> table{};
+  for (const auto& [csi, key] : legacy)
+    table[csi] = key;
+  return table;
+}();
 
-std::optional<uint16_t> letter_trailer_to_csi_number(char trailer) {
-  static const std::unordered_map<char, uint16_t> map{
-      {'A', 57352}, {'B', 57353}, {'C', 57351}, {'D', 57350}, {'E', 57427},
-      {'F', 8},     {'H', 7},     {'P', 11},    {'Q', 12},    {'S', 14},
-  };
-  auto result = map.find(trailer);
-  if (result == map.end())
-    return {};
+// Printable ASCII, which Electron names by the character itself
+constexpr auto kAsciiTable = [] {
+  std::array<char16_t, '~' - ' ' + 1> table{};
+  for (char16_t ch = ' '; ch <= '~'; ++ch)
+    table[ch - ' '] = ch;
+  return table;
+}();
 
-  return result->second;
-};
-
-std::vector<int> get_sub_sections(std::string_view section,
-                                  int missing) noexcept {
-  std::vector<std::string_view> p = string::split(section, ':');
-  std::vector<int> result(p.size(), missing);
-
-  for (size_t i = 0; i < p.size(); ++i) {
-    if (p[i].empty()) {
-      result[i] = missing;
-    } else {
-      const std::from_chars_result conv =
-          std::from_chars(p[i].begin(), p[i].end(), result[i]);
-      if (conv.ec != std::errc())
-        return {};
-    }
+// The key of letter terminated sequences, as a legacy number or functional
+// key number
+constexpr uint32_t letter_trailer_to_key(char trailer) {
+  switch (trailer) {
+    case 'A':
+      return 57352;
+    case 'B':
+      return 57353;
+    case 'C':
+      return 57351;
+    case 'D':
+      return 57350;
+    case 'E':
+      return 57427;
+    case 'F':
+      return 8;
+    case 'H':
+      return 7;
+    case 'P':
+      return 11;
+    case 'Q':
+      return 12;
+    case 'S':
+      return 14;
+    default:
+      return 0;
   }
-
-  return result;
 }
 
-std::vector<std::u16string> modifiers_to_strings(Modifiers::Type m) {
-  std::vector<std::u16string> result;
-  if (m & Modifiers::Meta)
-    result.push_back(u"meta");
-  if (m & Modifiers::Ctrl)
-    result.push_back(u"ctrl");
-  if (m & Modifiers::Shift)
-    result.push_back(u"shift");
-  if (m & Modifiers::Alt)
-    result.push_back(u"alt");
-  if (m & Modifiers::CapsLock)
-    result.push_back(u"capslock");
-  if (m & Modifiers::NumLock)
-    result.push_back(u"numlock");
-  return result;
+// Parses the first |count| colon separated numbers of |section| into
+// |values|, leaving the ones that are missing or empty as they were, and
+// returns how many were present
+size_t parse_sub_sections(std::string_view section,
+                          uint32_t* values,
+                          size_t count,
+                          bool* ok) noexcept {
+  size_t i = 0;
+  for (; i < count && !section.empty(); ++i) {
+    size_t end = section.find(':');
+    std::string_view part = section.substr(0, end);
+    if (!part.empty()) {
+      auto conv =
+          std::from_chars(part.data(), part.data() + part.size(), values[i]);
+      if (conv.ec != std::errc() || conv.ptr != part.data() + part.size()) {
+        *ok = false;
+        return i;
+      }
+    }
+    if (end == std::string_view::npos)
+      return i + 1;
+    section.remove_prefix(end + 1);
+  }
+  return i;
 }
 
 }  // namespace
 
-std::pair<Event::Type, std::vector<std::u16string>> ElectronKeyEventFromCSI(
-    std::string_view csi) noexcept {
-  std::u16string keyCode;
-  std::vector<std::u16string> result;
-  Event::Type event(Event::Invalid);
-  if (csi.empty()) {
-    return {event, result};
-  }
+KeyEvent KeyEventFromCSI(std::string_view csi) noexcept {
+  KeyEvent result;
+  if (csi.empty())
+    return result;
 
   char last_char = csi.back();
   csi.remove_suffix(1);
 
   static constexpr std::string_view possible_trailers{"u~ABCDEHFPQRS"};
-
   if (possible_trailers.find(last_char) == std::string_view::npos ||
-      (last_char == '~' && (csi == "200" || csi == "201"))) {
-    return {event, result};
+      (last_char == '~' && (csi == "200" || csi == "201")))
+    return result;
+
+  // key:alternates;modifiers:event;text
+  std::string_view sections[3];
+  for (std::string_view& section : sections) {
+    size_t end = csi.find(';');
+    section = csi.substr(0, end);
+    csi = end == std::string_view::npos ? std::string_view{}
+                                        : csi.substr(end + 1);
   }
 
-  std::vector<std::string_view> sections = string::split(csi, ';');
-  std::vector<int> first_section;
-  if (sections.size() > 0)
-    first_section = get_sub_sections(sections[0], 0);
-  std::vector<int> second_section;
-  if (sections.size() > 1)
-    second_section = get_sub_sections(sections[1], 1);
-  std::vector<int> third_section;
-  if (sections.size() > 2)
-    third_section = get_sub_sections(sections[2], 0);
+  bool ok = true;
+  uint32_t key[1] = {0};
+  uint32_t modifiers[2] = {1, Event::Down};
+  parse_sub_sections(sections[0], key, 1, &ok);
+  parse_sub_sections(sections[1], modifiers, 2, &ok);
+  result.codepoint_count = parse_sub_sections(
+      sections[2], result.codepoints, KeyEvent::kMaxCodepoints, &ok);
+  if (!ok)
+    return {};
 
-  uint32_t keynum = 0;
-  auto maybe_csi_number = letter_trailer_to_csi_number(last_char);
-  if (maybe_csi_number) {
-    keynum = maybe_csi_number.value();
-  } else {
-    if (first_section.empty())
-      return {event, result};
-    keynum = first_section[0];
+  uint32_t keynum = key[0];
+  if (uint32_t letter = letter_trailer_to_key(last_char)) {
+    keynum = letter;
+  } else if (sections[0].empty()) {
+    return {};
+  } else if (keynum == 13) {
+    keynum = last_char == 'u' ? 57345 : 57366;  // enter or f3
   }
+  if (keynum < kLegacyTable.size() && kLegacyTable[keynum] != 0)
+    keynum = kLegacyTable[keynum];
+  // Keys without a number can still have text
+  if ((keynum == 0 && result.codepoint_count == 0) || modifiers[0] == 0 ||
+      modifiers[1] < Event::Down || modifiers[1] > Event::Up)
+    return {};
 
-  if (second_section.size() > 0) {
-    auto new_modifiers = modifiers_to_strings(
-        static_cast<Modifiers::Type>(second_section[0] - 1));
-    result.insert(result.end(), new_modifiers.begin(), new_modifiers.end());
-  }
+  result.event = static_cast<Event::Type>(modifiers[1]);
+  result.modifiers = modifiers[0] - 1;
+  result.key = keynum;
+  return result;
+}
 
-  if (second_section.size() > 1) {
-    event = static_cast<Event::Type>(second_section[1]);
-    if (event == Event::Repeat) {
-      result.push_back(u"isautorepeat");
-    }
-  } else {
-    event = Event::Down;
+ElectronKeyEvent ToElectronKeyEvent(const KeyEvent& key) noexcept {
+  ElectronKeyEvent result;
+  if (key.event == Event::Invalid)
+    return result;
+
+  auto add = [&result](std::u16string_view name) {
+    result.modifiers[result.modifier_count++] = name;
+  };
+  if (key.modifiers & Modifiers::Meta)
+    add(u"meta");
+  if (key.modifiers & Modifiers::Ctrl)
+    add(u"ctrl");
+  if (key.modifiers & Modifiers::Shift)
+    add(u"shift");
+  if (key.modifiers & Modifiers::Alt)
+    add(u"alt");
+  if (key.modifiers & Modifiers::CapsLock)
+    add(u"capslock");
+  if (key.modifiers & Modifiers::NumLock)
+    add(u"numlock");
+
+  result.event = key.event;
+  if (key.event == Event::Repeat) {
+    result.event = Event::Down;
+    add(u"isautorepeat");
   }
 
-  if (keynum == 13) {
-    keyCode = last_char == 'u' ? u"enter" : u"f3";
-  } else if (keynum != 0) {
-    auto functional_number = csi_number_to_functional_number(keynum);
-    if (functional_number) {
-      keynum = functional_number.value();
-    }
-    keyCode = functional_key_number_to_electron_string(keynum);
-    if (keynum >= 57441 && keynum <= 57446) {
-      result.push_back(u"left");
-    } else if (keynum >= 57447 && keynum <= 57452) {
-      result.push_back(u"right");
+  if (key.key >= kFirstFunctionalKey && key.key <= kLastFunctionalKey) {
+    result.key_code = kFunctionalTable[key.key - kFirstFunctionalKey];
+    if (key.key >= 57441 && key.key <= 57446) {
+      add(u"left");
+    } else if (key.key >= 57447 && key.key <= 57452) {
+      add(u"right");
     }
   }
 
-  if (keyCode.empty()) {
-    // Electron only supports function keys and the US key layout
-    if (keynum >= ' ' && keynum <= '~') {
-      keyCode.push_back(keynum);
+  if (result.key_code.empty()) {
+    if (key.key >= ' ' && key.key <= '~') {
+      result.key_code = {&kAsciiTable[key.key - ' '], 1};
+    } else if (key.codepoint_count > 0) {
+      // Otherwise the text can be passed on, which is usually on key up
+      result.event = Event::Unicode;
     } else {
-      // So if it's not ASCII or a function key, check if we can pass off
-      // codepoints (usually on key up)
-      if (third_section.size() > 0) {
-        event = Event::Unicode;
-        for (auto codepoint : third_section)
-          keyCode.push_back(codepoint);
-      } else {
-        event = Event::Invalid;
-      }
+      result.event = Event::Invalid;
     }
   }
 
-  if (event == Event::Repeat) {
-    event = Event::Down;
-  }
-
-  result.push_back(keyCode);
-
-  return {event, result};
+  return result;
 }
 }  // namespace tty::keys
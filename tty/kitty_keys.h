@@ -3,10 +3,9 @@
 // Use of this source code is governed by a BSD-style license that can be found
 // in the LICENSE file.
 
+#include <cstddef>
 #include <cstdint>
-#include <string>
 #include <string_view>
-#include <vector>
 
 // see https://sw.kovidgoyal.net/kitty/keyboard-protocol/
 namespace tty::keys {
@@ -42,10 +41,46 @@ enum Type : int {
 };
 }
 
+// Functional keys are numbered from here on, legacy and letter terminated
+// sequences are translated to these numbers
+constexpr uint32_t kFirstFunctionalKey = 57344;
+constexpr uint32_t kLastFunctionalKey = 57452;
+
+// A key event as reported by the terminal
+struct KeyEvent {
+  static constexpr size_t kMaxCodepoints = 8;
+
+  Event::Type event = Event::Invalid;
+  int modifiers = Modifiers::None;
+  // The unicode codepoint of the key, or its functional key number
+  uint32_t key = 0;
+  // The text the key produced, when reported
+  uint32_t codepoints[kMaxCodepoints] = {};
+  size_t codepoint_count = 0;
+};
+
+// A key event in the terms of Electron's sendInputEvent, the names point to
+// static storage
+struct ElectronKeyEvent {
+  static constexpr size_t kMaxModifiers = 8;
+
+  Event::Type event = Event::Invalid;
+  std::u16string_view modifiers[kMaxModifiers];
+  size_t modifier_count = 0;
+  // Empty for Unicode events, which use the codepoints of the key event
+  std::u16string_view key_code;
+};
+
 void Enable();
 void Disable();
 
-std::pair<Event::Type, std::vector<std::u16string>> ElectronKeyEventFromCSI(
-    std::string_view csi) noexcept;
+// Decodes a kitty keyboard protocol CSI without allocating, returning an
+// Invalid event for anything else. Repeats are kept as Repeat events.
+KeyEvent KeyEventFromCSI(std::string_view csi) noexcept;
+
+// Electron only knows function keys and the US layout, other keys are
+// Unicode events of their text or Invalid without any. Repeats are presses
+// with the isautorepeat modifier.
+ElectronKeyEvent ToElectronKeyEvent(const KeyEvent& key) noexcept;
 
 }  // namespace tty::keys